@@ -19,7 +19,9 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <search.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "ply.h"
@@ -30,26 +32,25 @@
 
 static int loc_assign_binop(node_t *n, node_t *probe)
 {
-	node_t *l, *r, *stmt;
+	node_t *l, *r;
 
-	stmt = node_get_stmt(n);
 	l = n->binop.left;
 	r = n->binop.right;
 
+	/* try to compute the result in place */
 	l->dyn.loc = LOC_REG;
-	if (n->dyn.loc == LOC_REG && ((1 << n->dyn.reg) & DYN_REGS))
-		l->dyn.reg = n->dyn.reg;
-	else
-		l->dyn.reg = node_stmt_reg_get(stmt);
+	l->dyn.reg = node_probe_reg_get(probe, l,
+					n->dyn.loc == LOC_REG ? n->dyn.reg : -1);
 
 	if (l->dyn.reg >= 0)
 		goto ldone;
 
-	l->dyn.loc  = LOC_STACK;
-	if (n->dyn.loc == LOC_STACK)
+	if (n->dyn.loc == LOC_STACK || n->dyn.loc == LOC_SCRATCH) {
+		l->dyn.loc  = n->dyn.loc;
 		l->dyn.addr = n->dyn.addr;
-	else
-		l->dyn.addr = node_probe_stack_get(probe, l->dyn.size);
+	} else {
+		node_probe_mem_get(probe, l, l->dyn.size);
+	}
 
 ldone:
 	if (r->type == TYPE_INT &&
@@ -58,11 +59,9 @@ ldone:
 		goto rdone;
 
 	r->dyn.loc = LOC_REG;
-	r->dyn.reg = node_stmt_reg_get(stmt);
-	if (r->dyn.reg < 0) {
-		r->dyn.loc  = LOC_STACK;
-		r->dyn.addr = node_probe_stack_get(probe, r->dyn.size);
-	}
+	r->dyn.reg = node_probe_reg_get(probe, r, -1);
+	if (r->dyn.reg < 0)
+		node_probe_mem_get(probe, r, r->dyn.size);
 
 rdone:
 	return 0;
@@ -83,11 +82,6 @@ static int loc_assign_pre(node_t *n, void *_probe)
 		if (c) {
 			c->dyn.loc = LOC_REG;
 			c->dyn.reg = BPF_REG_0;
-			c->dyn.free_regs = DYN_REGS;
-		}
-
-		node_foreach(c, n->probe.stmts) {
-			c->dyn.free_regs = DYN_REGS;
 		}
 		return 0;
 
@@ -104,14 +98,13 @@ static int loc_assign_pre(node_t *n, void *_probe)
 		n->dyn.reg = BPF_REG_0;
 
 		c = n->assign.lval;
-		c->dyn.loc  = LOC_STACK;
-		c->dyn.addr = node_probe_stack_get(probe, c->dyn.size);
+		node_probe_mem_get(probe, c, c->dyn.size);
 
 		if (!n->assign.expr)
 			return 0;
 
 		if (n->assign.op == ALU_OP_MOV) {
-			n->assign.expr->dyn.loc  = LOC_STACK;
+			n->assign.expr->dyn.loc  = c->dyn.loc;
 			n->assign.expr->dyn.addr = c->dyn.addr;
 		} else {
 			n->assign.expr->dyn.loc = LOC_REG;
@@ -120,8 +113,7 @@ static int loc_assign_pre(node_t *n, void *_probe)
 		return 0;
 	case TYPE_METHOD:
 		c = n->method.map;
-		c->dyn.loc  = LOC_STACK;
-		c->dyn.addr = node_probe_stack_get(probe, c->dyn.size);
+		node_probe_mem_get(probe, c, c->dyn.size);
 		return 0;
 
 	case TYPE_RETURN:
@@ -144,17 +136,16 @@ static int loc_assign_pre(node_t *n, void *_probe)
 		/* upper node wants result in a register, but we still
 		 * need stack space to bounce the data in */
 		if (n->dyn.loc == LOC_REG)
-			n->dyn.addr = node_probe_stack_get(probe, n->dyn.size);
+			n->dyn.addr = node_probe_stack_get(probe, n, n->dyn.size);
 
 		c = n->map.rec;
-		c->dyn.loc  = LOC_STACK;
-		c->dyn.addr = node_probe_stack_get(probe, c->dyn.size);
+		node_probe_mem_get(probe, c, c->dyn.size);
 		return 0;
 
 	case TYPE_REC:
 		addr = n->dyn.addr;
 		node_foreach(c, n->rec.vargs) {
-			c->dyn.loc  = LOC_STACK;
+			c->dyn.loc  = n->dyn.loc;
 			c->dyn.addr = addr;
 			addr += c->dyn.size;
 		}
@@ -168,15 +159,120 @@ static int loc_assign_pre(node_t *n, void *_probe)
 	return -ENOSYS;
 }
 
+static int loc_number_post(node_t *n, void *_seq)
+{
+	int *seq = _seq;
+
+	n->dyn.seq = (*seq)++;
+
+	switch (n->type) {
+	case TYPE_MAP:
+	case TYPE_ASSIGN:
+	case TYPE_METHOD:
+		/* map lookups and updates are done via helpers */
+		n->dyn.clobber_regs = CALLER_REGS;
+		break;
+	default:
+		/* calls are marked by their provider during
+		 * annotation */
+		break;
+	}
+
+	return 0;
+}
+
+static int loc_log2_post(node_t *n, void *_null)
+{
+	if (n->type == TYPE_CALL && !strcmp(n->string, "log2"))
+		n->dyn.clobber_regs = CALLER_REGS;
+
+	return 0;
+}
+
+static int loc_reset_pre(node_t *n, void *_null)
+{
+	n->dyn.loc  = LOC_NOWHERE;
+	n->dyn.reg  = 0;
+	n->dyn.addr = 0;
+	return 0;
+}
+
+static int loc_assign_probe(node_t *probe)
+{
+	int err;
+
+	err = node_walk(probe, loc_assign_pre, NULL, probe);
+	if (err || !probe->dyn.probe.scratch || probe->dyn.probe.scratch_reg)
+		return err;
+
+	/* the scratch buffer is needed, but its register might
+	 * already be in use. start over with it reserved. */
+	node_walk(probe, loc_reset_pre, NULL, NULL);
+	free(probe->dyn.probe.slots);
+	probe->dyn.probe.slots   = NULL;
+	probe->dyn.probe.n_slots = 0;
+	probe->dyn.probe.sp      = 0;
+	probe->dyn.probe.scratch = 0;
+	probe->dyn.probe.scratch_reg = SCRATCH_REG;
+
+	return node_walk(probe, loc_assign_pre, NULL, probe);
+}
+
+static void loc_scratch_mdyn(node_t *script, size_t size)
+{
+	mdyn_t *mdyn;
+
+	for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next) {
+		if (!strcmp(mdyn->map->string, "scratch"))
+			break;
+	}
+
+	if (!mdyn) {
+		mdyn = calloc(1, sizeof(*mdyn));
+		assert(mdyn);
+
+		mdyn->map = node_str_new(strdup("scratch"));
+
+		if (!script->dyn.script.mdyns)
+			script->dyn.script.mdyns = mdyn;
+		else
+			insque_tail(mdyn, script->dyn.script.mdyns);
+	}
+
+	/* one buffer is shared by all probes */
+	if (size > mdyn->map->dyn.size)
+		mdyn->map->dyn.size = size;
+}
+
 static int loc_assign(node_t *script)
 {
 	node_t *probe;
-	int err;
+	int err, seq;
 	
 	node_foreach(probe, script->script.probes) {
-		err = node_walk(probe, loc_assign_pre, NULL, probe);
+		/* number nodes in evaluation order, this is what
+		 * determines the live range of each value. */
+		seq = 0;
+		node_walk(probe, NULL, loc_number_post, &seq);
+
+		/* log2 is a leaf when inlined, but when it is shared
+		 * as a subprogram every call clobbers like a helper. */
+		if (node_probe_call_count(probe, "log2") > 1)
+			node_walk(probe, NULL, loc_log2_post, NULL);
+
+		err = loc_assign_probe(probe);
 		if (err)
 			return err;
+
+		_d("%s: %zd byte stack frame, %d slots", probe->string,
+		   -probe->dyn.probe.sp, probe->dyn.probe.n_slots);
+
+		if (!probe->dyn.probe.scratch)
+			continue;
+
+		_d("%s: %zu bytes of scratch space", probe->string,
+		   probe->dyn.probe.scratch);
+		loc_scratch_mdyn(script, probe->dyn.probe.scratch);
 	}
 
 	return 0;
@@ -399,12 +495,175 @@ static int static_post(node_t *n, void *_null)
 	return 0;
 }
 
+static void const_fold_int(node_t *n, int64_t val)
+{
+	switch (n->type) {
+	case TYPE_BINOP:
+		node_free(n->binop.left);
+		node_free(n->binop.right);
+		free(n->string);
+		n->string = NULL;
+		break;
+	case TYPE_NOT:
+		node_free(n->not);
+		break;
+	default:
+		assert(0);
+	}
+
+	n->type = TYPE_INT;
+	n->integer = val;
+	n->dyn.type = TYPE_INT;
+	n->dyn.size = 8;
+}
+
+static int const_fold_binop(node_t *n)
+{
+	node_t *l = n->binop.left, *r = n->binop.right;
+	uint64_t a = l->integer, b = r->integer;
+	int64_t val;
+
+	if (l->type != TYPE_INT || r->type != TYPE_INT)
+		return 0;
+
+	if (n->binop.type == BINOP_JMP) {
+		switch (n->binop.jmp) {
+		case JMP_JEQ:  val = l->integer == r->integer; break;
+		case JMP_JNE:  val = l->integer != r->integer; break;
+		case JMP_JSGT: val = l->integer >  r->integer; break;
+		case JMP_JSGE: val = l->integer >= r->integer; break;
+		default:
+			return 0;
+		}
+
+		goto fold;
+	}
+
+	/* mirror the semantics of the generated code, i.e. 64-bit
+	 * unsigned arithmetic and logical shifts. */
+	switch (n->binop.alu) {
+	case ALU_OP_ADD: val = a + b; break;
+	case ALU_OP_SUB: val = a - b; break;
+	case ALU_OP_MUL: val = a * b; break;
+	case ALU_OP_OR:  val = a | b; break;
+	case ALU_OP_AND: val = a & b; break;
+	case ALU_OP_XOR: val = a ^ b; break;
+	case ALU_OP_DIV:
+	case ALU_OP_MOD:
+		if (!b) {
+			_e("%s: division by zero", n->string);
+			return -EINVAL;
+		}
+
+		val = (n->binop.alu == ALU_OP_DIV) ? a / b : a % b;
+		break;
+	case ALU_OP_LSH:
+	case ALU_OP_RSH:
+		/* leave out of range shifts to the verifier */
+		if (b >= 64)
+			return 0;
+
+		val = (n->binop.alu == ALU_OP_LSH) ? a << b : a >> b;
+		break;
+	default:
+		return 0;
+	}
+
+fold:
+	_d("%"PRId64" %s %"PRId64" => %"PRId64, l->integer, n->string,
+	   r->integer, val);
+	const_fold_int(n, val);
+	return 0;
+}
+
+static int const_fold_post(node_t *n, void *_null)
+{
+	switch (n->type) {
+	case TYPE_BINOP:
+		return const_fold_binop(n);
+	case TYPE_NOT:
+		if (n->not->type == TYPE_INT)
+			const_fold_int(n, !n->not->integer);
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+static int const_fold_probe(node_t *script, node_t *probe)
+{
+	node_t *pred = probe->probe.pred, *stmt, *dead;
+
+	/* nothing is evaluated after a return */
+	node_foreach(stmt, probe->probe.stmts) {
+		if (stmt->type != TYPE_RETURN)
+			continue;
+
+		while ((dead = stmt->next)) {
+			_d("%s: removing unreachable %s", probe->string,
+			   node_str(dead));
+			remque(dead);
+			node_free(dead);
+		}
+		break;
+	}
+
+	if (!pred || pred->type != TYPE_INT)
+		return 0;
+
+	if (pred->integer) {
+		_d("%s: predicate is always true", probe->string);
+		probe->probe.pred = NULL;
+		node_free(pred);
+		return 0;
+	}
+
+	_d("%s: predicate is always false, removing probe", probe->string);
+	if (script->script.probes == probe)
+		script->script.probes = probe->next;
+
+	remque(probe);
+	node_free(probe);
+	return 0;
+}
+
+static int const_fold(node_t *script)
+{
+	node_t *probe, *next;
+	int err;
+
+	err = node_walk(script, NULL, const_fold_post, NULL);
+	if (err)
+		return err;
+
+	for (probe = script->script.probes; probe; probe = next) {
+		next = probe->next;
+
+		err = const_fold_probe(script, probe);
+		if (err)
+			return err;
+	}
+
+	if (!script->script.probes) {
+		_e("no probes left after removing those that can never fire");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 int annotate_script(node_t *script)
 {
 	int err;
 
+	/* evaluate everything that is known at compile time. this
+	 * may free whole probes, so it must run before providers get
+	 * to annotate calls and register maps that point into them. */
+	err = const_fold(script);
+	_d("constant folding done: %d", err);
+
 	/* insert all statically known types */
-	err = node_walk(script, NULL, static_post, NULL);
+	err = err? : node_walk(script, NULL, static_post, NULL);
 	_d("static inference done: %d", err);
 
 	/* infer the rest. ...yes do three passes, this catches cases
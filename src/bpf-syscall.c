@@ -17,6 +17,7 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -34,27 +35,67 @@ static __u64 ptr_to_u64(const void *ptr)
         return (__u64) (unsigned long) ptr;
 }
 
-int bpf_prog_load(const struct bpf_insn *insns, int insn_cnt)
+int bpf_prog_load(enum bpf_prog_type type,
+		  const struct bpf_insn *insns, int insn_cnt)
 {
 	union bpf_attr attr;
+	int fd;
 
 	/* required since the kernel checks that unused fields and pad
 	 * bytes are zeroed */
 	memset(&attr, 0, sizeof(attr));
 
-	attr.prog_type = BPF_PROG_TYPE_KPROBE;
+	attr.prog_type = type;
 	attr.insns     = ptr_to_u64(insns);
 	attr.insn_cnt  = insn_cnt;
 	attr.license   = ptr_to_u64("GPL");
+	attr.kern_version = LINUX_VERSION_CODE;
+
+	/* the verifier is a lot slower when it has to log, so only
+	 * enable it when the program has already failed once, to
+	 * find out why. */
+	fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+	if (fd >= 0)
+		return fd;
+
 	attr.log_buf   = ptr_to_u64(bpf_log_buf);
 	attr.log_size  = LOG_BUF_SIZE;
 	attr.log_level = 1;
-	attr.kern_version = LINUX_VERSION_CODE;
-	
 	return syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
 }
 
-int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries)
+int bpf_prog_info(int fd, struct bpf_prog_info *info)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	memset(info, 0, sizeof(*info));
+
+	attr.info.bpf_fd   = fd;
+	attr.info.info_len = sizeof(*info);
+	attr.info.info     = ptr_to_u64(info);
+
+	return syscall(__NR_bpf, BPF_OBJ_GET_INFO_BY_FD, &attr, sizeof(attr));
+}
+
+/* 5.8+, returns an fd that keeps the stats enabled until closed */
+int bpf_enable_stats(int type)
+{
+#if HAVE_DECL_BPF_ENABLE_STATS
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.enable_stats.type = type;
+
+	return syscall(__NR_bpf, BPF_ENABLE_STATS, &attr, sizeof(attr));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int __bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz,
+		     int entries, int flags)
 {
 	union bpf_attr attr;
 
@@ -66,10 +107,16 @@ int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries)
 	attr.key_size = key_sz;
 	attr.value_size = val_sz;
 	attr.max_entries = entries;
+	attr.map_flags = flags;
 
 	return syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
 }
 
+int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries)
+{
+	return __bpf_map_create(type, key_sz, val_sz, entries, 0);
+}
+
 
 static int bpf_map_op(enum bpf_cmd cmd, int fd,
 		      void *key, void *val_or_next, int flags)
@@ -94,6 +141,26 @@ int bpf_map_update(int fd, void *key, void *val, int flags)
 	return bpf_map_op(BPF_MAP_UPDATE_ELEM, fd, key, val, flags);
 }
 
+/* 5.6+, a single syscall for `count` elements */
+int bpf_map_update_batch(int fd, void *keys, void *vals, uint32_t count)
+{
+#ifdef HAVE_UNION_BPF_ATTR_BATCH
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.batch.map_fd = fd;
+	attr.batch.keys   = ptr_to_u64(keys);
+	attr.batch.values = ptr_to_u64(vals);
+	attr.batch.count  = count;
+
+	return syscall(__NR_bpf, BPF_MAP_UPDATE_BATCH, &attr, sizeof(attr));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 int bpf_map_delete(int fd, void *key)
 {
 	return bpf_map_op(BPF_MAP_DELETE_ELEM, fd, key, NULL, 0);
@@ -103,3 +170,10 @@ int bpf_map_next(int fd, void *key, void *next_key)
 {
 	return bpf_map_op(BPF_MAP_GET_NEXT_KEY, fd, key, next_key, 0);
 }
+
+long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
+		     int cpu, int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, hw_event, pid, cpu,
+		       group_fd, flags);
+}
@@ -19,17 +19,37 @@
 
 #pragma once
 
+#include "config.h"
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
 #include <linux/bpf.h>
+#include <linux/perf_event.h>
 
 #define LOG_BUF_SIZE 0x20000
 
+#ifndef BPF_F_MMAPABLE
+#define BPF_F_MMAPABLE (1U << 10)
+#endif
+
 extern char bpf_log_buf[LOG_BUF_SIZE];
 
-int bpf_prog_load(const struct bpf_insn *insns, int insn_cnt);
+int bpf_prog_load(enum bpf_prog_type type,
+		  const struct bpf_insn *insns, int insn_cnt);
+int bpf_prog_info(int fd, struct bpf_prog_info *info);
+int bpf_enable_stats(int type);
 
-int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries);
+int __bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz,
+		     int entries, int flags);
+int   bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries);
 
 int bpf_map_lookup(int fd, void *key, void *val);
 int bpf_map_update(int fd, void *key, void *val, int flags);
+int bpf_map_update_batch(int fd, void *keys, void *vals, uint32_t count);
 int bpf_map_delete(int fd, void *key);
 int bpf_map_next  (int fd, void *key, void *next_key);
+
+long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
+		     int cpu, int group_fd, unsigned long flags);
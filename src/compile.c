@@ -19,10 +19,16 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "ply.h"
+#include "bpf-syscall.h"
 #include "compile.h"
+#include "filter.h"
+#include "governor.h"
 #include "lang/ast.h"
 #include "pvdr/pvdr.h"
 
@@ -61,6 +67,20 @@ static const char *bpf_func_name(enum bpf_func_id id)
 		return "get_current_uid_gid";
 	case BPF_FUNC_get_current_comm:
 		return "get_current_comm";
+	case BPF_FUNC_get_current_cgroup_id:
+		return "get_current_cgroup_id";
+	case BPF_FUNC_get_smp_processor_id:
+		return "get_smp_processor_id";
+	case BPF_FUNC_get_prandom_u32:
+		return "get_prandom_u32";
+	case BPF_FUNC_get_stackid:
+		return "get_stackid";
+	case BPF_FUNC_tail_call:
+		return "tail_call";
+#if HAVE_DECL_BPF_FUNC_MAP_PEEK_ELEM
+	case BPF_FUNC_map_peek_elem:
+		return "map_peek_elem";
+#endif
 
 	default:
 		return NULL;
@@ -119,10 +139,19 @@ void dump_insn(struct bpf_insn insn, size_t ip)
 	case BPF_ST:
 	case BPF_STX:
 		off = OFF_DST;
-		fputs("st", stderr);
+		fputs(BPF_MODE(insn.code) == BPF_XADD ? "xadd" : "st", stderr);
 		dump_size(insn.code);
 		break;
 
+	case BPF_ALU:
+		if (BPF_OP(insn.code) != BPF_END)
+			goto unknown;
+
+		fprintf(stderr, "%s%d\tr%u\n",
+			BPF_SRC(insn.code) == BPF_TO_BE ? "be" : "le",
+			insn.imm, insn.dst_reg);
+		return;
+
 	case BPF_ALU64:
 		switch (BPF_OP(insn.code)) {
 		case BPF_MOV: fputs("mov\t", stderr); break;
@@ -150,6 +179,11 @@ void dump_insn(struct bpf_insn insn, size_t ip)
 		case BPF_CALL:
 			fputs("call\t", stderr);
 
+			if (insn.src_reg == BPF_PSEUDO_CALL) {
+				fprintf(stderr, "pc%+d\n", insn.imm);
+				return;
+			}
+
 			name = bpf_func_name(insn.imm);
 			if (name)
 				fprintf(stderr, "%s\n", name);
@@ -166,6 +200,15 @@ void dump_insn(struct bpf_insn insn, size_t ip)
 		case BPF_JGE:  fputs("jge\t", stderr); break;
 		case BPF_JSGE: fputs("jsge\t", stderr); break;
 		case BPF_JSGT: fputs("jsgt\t", stderr); break;
+		case BPF_JSET: fputs("jset\t", stderr); break;
+#ifdef BPF_JLT
+		case BPF_JLT:  fputs("jlt\t", stderr); break;
+		case BPF_JLE:  fputs("jle\t", stderr); break;
+#endif
+#ifdef BPF_JSLT
+		case BPF_JSLT: fputs("jslt\t", stderr); break;
+		case BPF_JSLE: fputs("jsle\t", stderr); break;
+#endif
 		default:
 			goto unknown;
 		}
@@ -181,8 +224,14 @@ void dump_insn(struct bpf_insn insn, size_t ip)
 	if (BPF_CLASS(insn.code) == BPF_LDX || BPF_CLASS(insn.code) == BPF_STX)
 		goto reg_src;
 
+	/* the size bits of BPF_ST overlap BPF_SRC, it is always an
+	 * immediate store. */
+	if (BPF_CLASS(insn.code) == BPF_ST)
+		goto imm_src;
+
 	switch (BPF_SRC(insn.code)) {
 	case BPF_K:
+	imm_src:
 		fprintf(stderr, "#%s0x%x", insn.imm < 0 ? "-" : "",
 			insn.imm < 0 ? -insn.imm : insn.imm);
 		break;
@@ -206,8 +255,25 @@ unknown:
 
 void emit(prog_t *prog, struct bpf_insn insn)
 {
+	size_t len = prog->ip - prog->insns;
+
 	if (G.debug)
-		dump_insn(insn, prog->ip - prog->insns);
+		dump_insn(insn, len);
+
+	if (len == prog->cap) {
+		if (len == PROG_INSNS_MAX) {
+			if (!prog->err)
+				_e("more than %d instructions", PROG_INSNS_MAX);
+			prog->err = -E2BIG;
+			return;
+		}
+
+		prog->cap = prog->cap ? (prog->cap << 1) : 512;
+		prog->insns = realloc(prog->insns,
+				      prog->cap * sizeof(*prog->insns));
+		assert(prog->insns);
+		prog->ip = prog->insns + len;
+	}
 
 	*(prog->ip)++ = insn;
 }
@@ -218,7 +284,7 @@ int emit_stack_zero(prog_t *prog, const node_t *n)
 
 	emit(prog, MOV_IMM(BPF_REG_0, 0));
 	for (i = 0; i < n->dyn.size; i += sizeof(int64_t))
-		emit(prog, STXDW(BPF_REG_10, n->dyn.addr + i, BPF_REG_0));
+		emit(prog, STXDW(mem_base(n->dyn.addr), n->dyn.addr + i, BPF_REG_0));
 
 	return 0;
 }
@@ -253,9 +319,10 @@ static int emit_xfer_literal(prog_t *prog, const dyn_t *to,
 		return 0;
 
 	case LOC_STACK:
+	case LOC_SCRATCH:
 		for (at = to->addr; size;
 		     at += sizeof(*s32), size -= sizeof(*s32), s32++)
-			emit(prog, STW_IMM(BPF_REG_10, at, *s32));
+			emit(prog, STW_IMM(mem_base(to->addr), at, *s32));
 		return 0;
 	}
 
@@ -278,7 +345,8 @@ static int emit_xfer_reg(prog_t *prog, const dyn_t *to, int from)
 		return 0;
 
 	case LOC_STACK:
-		emit(prog, STXDW(BPF_REG_10, to->addr, from));
+	case LOC_SCRATCH:
+		emit(prog, STXDW(mem_base(to->addr), to->addr, from));
 		return 0;
 	}
 
@@ -294,10 +362,11 @@ static int emit_xfer_stack(prog_t *prog, const dyn_t *to, ssize_t from)
 		return -EINVAL;
 
 	case LOC_REG:
-		emit(prog, LDXDW(to->reg, from, BPF_REG_10));
+		emit(prog, LDXDW(to->reg, from, mem_base(from)));
 		return 0;
 
 	case LOC_STACK:
+	case LOC_SCRATCH:
 		_e("stack<->stack transfer not implemented");
 		return -ENOSYS;
 	}
@@ -317,6 +386,7 @@ int emit_xfer_dyns(prog_t *prog, const dyn_t *to, const dyn_t *from)
 		return emit_xfer_reg(prog, to, from->reg);
 
 	case LOC_STACK:
+	case LOC_SCRATCH:
 		return emit_xfer_stack(prog, to, from->addr);
 	}
 
@@ -383,9 +453,28 @@ int emit_log2_raw(prog_t *prog, int dst, int src)
 	return 0;
 }
 
+int emit_subprog_call(prog_t *prog, const subprog_t *sub, node_t *call)
+{
+	subprog_call_t *sc;
+
+	if (prog->n_calls == SUBPROG_CALLS_MAX) {
+		_e("too many calls to subprograms");
+		return -ENOSPC;
+	}
+
+	sc = &prog->calls[prog->n_calls++];
+	sc->sub  = sub;
+	sc->call = call;
+	sc->at   = prog->ip - prog->insns;
+
+	/* target is filled in by compile_subprogs */
+	emit(prog, INSN(BPF_JMP | BPF_CALL, 0, BPF_PSEUDO_CALL, 0, 0));
+	return 0;
+}
+
 int emit_read_raw(prog_t *prog, ssize_t to, int from, size_t size)
 {
-	emit(prog, MOV(BPF_REG_1, BPF_REG_10));
+	emit(prog, MOV(BPF_REG_1, mem_base(to)));
 	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_1, to));
 	emit(prog, MOV_IMM(BPF_REG_2, size));
 	emit(prog, MOV(BPF_REG_3, from));
@@ -393,14 +482,15 @@ int emit_read_raw(prog_t *prog, ssize_t to, int from, size_t size)
 	return 0;
 }
 
-int emit_map_update_raw(prog_t *prog, int fd, ssize_t key, ssize_t val)
+int emit_map_update_raw(prog_t *prog, int fd, ssize_t key, ssize_t val,
+			int flags)
 {
 	emit_ld_mapfd(prog, BPF_REG_1, fd);
-	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
+	emit(prog, MOV(BPF_REG_2, mem_base(key)));
 	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_2, key));
-	emit(prog, MOV(BPF_REG_3, BPF_REG_10));
+	emit(prog, MOV(BPF_REG_3, mem_base(val)));
 	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_3, val));
-	emit(prog, MOV_IMM(BPF_REG_4, 0));
+	emit(prog, MOV_IMM(BPF_REG_4, flags));
 	emit(prog, CALL(BPF_FUNC_map_update_elem));
 	return 0;
 }
@@ -408,7 +498,7 @@ int emit_map_update_raw(prog_t *prog, int fd, ssize_t key, ssize_t val)
 int emit_map_delete_raw(prog_t *prog, int fd, ssize_t key)
 {
 	emit_ld_mapfd(prog, BPF_REG_1, fd);
-	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
+	emit(prog, MOV(BPF_REG_2, mem_base(key)));
 	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_2, key));
 	emit(prog, CALL(BPF_FUNC_map_delete_elem));
 	return 0;
@@ -417,12 +507,92 @@ int emit_map_delete_raw(prog_t *prog, int fd, ssize_t key)
 int emit_map_lookup_raw(prog_t *prog, int fd, ssize_t addr)
 {
 	emit_ld_mapfd(prog, BPF_REG_1, fd);
-	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
+	emit(prog, MOV(BPF_REG_2, mem_base(addr)));
 	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_2, addr));
 	emit(prog, CALL(BPF_FUNC_map_lookup_elem));
 	return 0;
 }
 
+/* scalars live in the only slot of an array map, so there is never
+ * a missing key to handle. on kernels that can not address map
+ * values directly, fall back to a lookup of key 0. */
+int emit_scalar_addr(prog_t *prog, int reg, node_t *map)
+{
+	mdyn_t *mdyn = node_map_get_mdyn(map);
+
+	if (mdyn->direct) {
+		emit_ld_mapvalue(prog, reg, mdyn->mapfd, 0);
+		return 0;
+	}
+
+	emit_map_lookup_raw(prog, mdyn->mapfd, map->map.rec->dyn.addr);
+
+	/* never taken, but the verifier insists */
+	emit(prog, JMP_IMM(JMP_JNE, BPF_REG_0, 0, 2));
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, EXIT);
+
+	if (reg != BPF_REG_0)
+		emit(prog, MOV(reg, BPF_REG_0));
+	return 0;
+}
+
+/* count() on a scalar adds to the slot in place, the others always
+ * update their value in place */
+static int method_in_place(node_t *map)
+{
+	static const char *always[] = {
+		"distinct", "sum", "min", "max", "avg", "stats", NULL
+	};
+	node_t *method = map->parent;
+	const char **name;
+
+	if (method->type != TYPE_METHOD)
+		return 0;
+
+	for (name = always; *name; name++)
+		if (!strcmp(method->method.call->string, *name))
+			return 1;
+
+	return node_map_is_scalar(map) &&
+		!strcmp(method->method.call->string, "count");
+}
+
+static int emit_scalar_load(prog_t *prog, node_t *n)
+{
+	size_t i;
+
+	emit_scalar_addr(prog, BPF_REG_1, n);
+
+	for (i = 0; i < n->dyn.size; i += sizeof(int64_t)) {
+		emit(prog, LDXDW(BPF_REG_0, i, BPF_REG_1));
+		emit(prog, STXDW(mem_base(n->dyn.addr), n->dyn.addr + i, BPF_REG_0));
+	}
+
+	if (n->dyn.loc == LOC_REG)
+		emit_xfer_stack(prog, &n->dyn, n->dyn.addr);
+
+	return 0;
+}
+
+static int emit_scalar_store(prog_t *prog, node_t *n, int zero)
+{
+	size_t i;
+
+	emit_scalar_addr(prog, BPF_REG_1, n);
+
+	if (zero)
+		emit(prog, MOV_IMM(BPF_REG_0, 0));
+
+	for (i = 0; i < n->dyn.size; i += sizeof(int64_t)) {
+		if (!zero)
+			emit(prog, LDXDW(BPF_REG_0, n->dyn.addr + i, mem_base(n->dyn.addr)));
+		emit(prog, STXDW(BPF_REG_1, i, BPF_REG_0));
+	}
+
+	return 0;
+}
+
 int emit_map_load(prog_t *prog, node_t *n)
 {
 	/* when overriding the current value, there is no need to load
@@ -431,6 +601,17 @@ int emit_map_load(prog_t *prog, node_t *n)
 	    n->parent->assign.op == ALU_OP_MOV)
 		return 0;
 
+	/* topk() always stores a fresh estimate */
+	if (n->parent->type == TYPE_METHOD &&
+	    !strcmp(n->parent->method.call->string, "topk"))
+		return 0;
+
+	if (method_in_place(n))
+		return 0;
+
+	if (node_map_is_scalar(n))
+		return emit_scalar_load(prog, n);
+
 	emit_stack_zero(prog, n);
 
 	emit_map_lookup_raw(prog, node_map_get_fd(n), n->map.rec->dyn.addr);
@@ -496,13 +677,13 @@ int emit_binop(prog_t *prog, node_t *binop)
 	node_t *l = binop->binop.left, *r = binop->binop.right;
 	int imm = 0;
 
-	if (l->dyn.loc == LOC_STACK)
+	if (l->dyn.loc == LOC_STACK || l->dyn.loc == LOC_SCRATCH)
 		l->dyn.reg = BPF_REG_0;
 
 	if (l->type == TYPE_INT || l->dyn.loc != LOC_REG)
 		emit_xfer_dyn(prog, &dyn_reg[l->dyn.reg], l);
 
-	if (r->dyn.loc == LOC_STACK)
+	if (r->dyn.loc == LOC_STACK || r->dyn.loc == LOC_SCRATCH)
 		r->dyn.reg = BPF_REG_1;
 
 	if (r->type == TYPE_INT || r->dyn.loc != LOC_REG) {
@@ -532,6 +713,10 @@ int emit_assign(prog_t *prog, node_t *assign)
 	int err;
 
 	if (!expr) {
+		/* array slots can not be deleted, only cleared */
+		if (node_map_is_scalar(map))
+			return emit_scalar_store(prog, map, 1);
+
 		emit_map_delete_raw(prog, node_map_get_fd(map),
 				    map->map.rec->dyn.addr);
 		return 0;
@@ -559,8 +744,11 @@ int emit_assign(prog_t *prog, node_t *assign)
 			return err;
 	}
 
+	if (node_map_is_scalar(map))
+		return emit_scalar_store(prog, map, 0);
+
 	emit_map_update_raw(prog, node_map_get_fd(map),
-			    map->map.rec->dyn.addr, map->dyn.addr);
+			    map->map.rec->dyn.addr, map->dyn.addr, BPF_ANY);
 	return 0;
 }
 
@@ -568,8 +756,14 @@ int emit_method(prog_t *prog, node_t *method)
 {
 	node_t *map = method->method.map;
 
+	if (method_in_place(map))
+		return 0;
+
+	if (node_map_is_scalar(map))
+		return emit_scalar_store(prog, map, 0);
+
 	emit_map_update_raw(prog, node_map_get_fd(map),
-			    map->map.rec->dyn.addr, map->dyn.addr);
+			    map->map.rec->dyn.addr, map->dyn.addr, BPF_ANY);
 	return 0;
 }
 
@@ -602,7 +796,7 @@ static int compile_post(node_t *n, void *_prog)
 
 	switch (n->type) {
 	case TYPE_INT:
-		if (n->dyn.loc != LOC_STACK)
+		if (n->dyn.loc != LOC_STACK && n->dyn.loc != LOC_SCRATCH)
 			break;
 		/* fall-through */
 	case TYPE_STR:
@@ -652,7 +846,8 @@ static int compile_post(node_t *n, void *_prog)
 	   n->string ? : type_str(n->type), n->string ? "" : ">",
 	   type_str(n->type), type_str(n->dyn.type), n->dyn.size);
 
-	return err;
+	/* stop at the first instruction that did not fit */
+	return err ? : prog->err;
 }
 
 static int compile_walk(node_t *n, prog_t *prog)
@@ -689,44 +884,355 @@ static int compile_pred(node_t *pred, prog_t *prog)
 	return 0;
 }
 
-prog_t *compile_probe(node_t *probe)
+static int compile_scratch(node_t *probe, prog_t *prog)
+{
+	node_t *script = node_get_script(probe);
+	ssize_t key = -(ssize_t)sizeof(uint32_t);
+	mdyn_t *mdyn;
+
+	for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next) {
+		if (!strcmp(mdyn->map->string, "scratch"))
+			break;
+	}
+
+	if (!mdyn) {
+		_e("%s: scratch buffer missing", probe->string);
+		return -ENOENT;
+	}
+
+	/* the buffer is the only value of a per-CPU array, look up
+	 * its address once and keep it for the entire probe. */
+	emit(prog, STW_IMM(BPF_REG_10, key, 0));
+	emit_map_lookup_raw(prog, mdyn->mapfd, key);
+	emit(prog, JMP_IMM(JMP_JNE, BPF_REG_0, 0, 2));
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, EXIT);
+	emit(prog, MOV(probe->dyn.probe.scratch_reg, BPF_REG_0));
+	return 0;
+}
+
+/* emit each subprogram that was called, once, after the main
+ * program and resolve the calls to it. */
+static int compile_subprogs(prog_t *prog)
+{
+	const subprog_t *sub;
+	size_t entry;
+	int i, j, err;
+
+	for (i = 0; i < prog->n_calls; i++) {
+		sub = prog->calls[i].sub;
+
+		for (j = 0; j < i; j++) {
+			if (prog->calls[j].sub == sub)
+				break;
+		}
+
+		if (j < i)
+			continue;
+
+		entry = prog->ip - prog->insns;
+		_d("%s: subprogram at %zu", sub->name, entry);
+
+		err = sub->emit(prog, prog->calls[i].call);
+		if (err)
+			return err;
+
+		/* the call sites, or the subprogram, may not have made it
+		 * into the buffer. */
+		if (prog->err)
+			return prog->err;
+
+		for (j = i; j < prog->n_calls; j++) {
+			if (prog->calls[j].sub != sub)
+				continue;
+
+			prog->insns[prog->calls[j].at].imm =
+				entry - prog->calls[j].at - 1;
+		}
+	}
+
+	return 0;
+}
+
+static prog_t *prog_new(int split)
 {
 	prog_t *prog;
-	node_t *stmt;
-	int err;
 
 	prog = calloc(1, sizeof(*prog));
-	if (!prog)
-		return NULL;
+	assert(prog);
 
-	prog->ip = prog->insns;
+	prog->split = split;
+	return prog;
+}
 
-	_d("");
+/* the first part is attached, and closed, by its provider. the
+ * other parts of a split probe, and the array that links them, are
+ * ours. */
+void prog_free(prog_t *prog)
+{
+	prog_t *next, *head = prog;
+
+	if (head && head->split && !G.dump)
+		close(head->tail_fd);
 
+	for (; prog; prog = next) {
+		next = prog->next;
+		if (prog != head && prog->fd > 0)
+			close(prog->fd);
+
+		free(prog->insns);
+		free(prog);
+	}
+}
+
+static int compile_head(node_t *probe, prog_t *prog, int first)
+{
 	/* context (pt_regs) pointer is supplied in r1 */
 	emit(prog, MOV(BPF_REG_9, BPF_REG_1));
 
+	if (first) {
+		filter_compile(probe, prog);
+		governor_compile(probe, prog);
+	}
+
+	if (probe->dyn.probe.scratch_reg)
+		return compile_scratch(probe, prog);
+
+	return 0;
+}
+
+static void compile_end(node_t *last, prog_t *prog)
+{
+	if (last->type == TYPE_RETURN)
+		return;
+
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, EXIT);
+}
+
+#define TAIL_CALL_INSNS 7
+
+static void compile_tail_call(prog_t *prog, int fd, int index)
+{
+	emit(prog, MOV(BPF_REG_1, BPF_REG_9));
+	emit_ld_mapfd(prog, BPF_REG_2, fd);
+	emit(prog, MOV_IMM(BPF_REG_3, index));
+	emit(prog, CALL(BPF_FUNC_tail_call));
+
+	/* only reached if the tail call fails */
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, EXIT);
+}
+
+static int compile_whole(node_t *probe, prog_t *prog)
+{
+	node_t *stmt;
+	int err;
+
+	err = compile_head(probe, prog, 1);
+	if (err)
+		return err;
+
 	err = compile_pred(probe->probe.pred, prog);
 	if (err)
-		goto err_free;
+		return err;
 
 	node_foreach(stmt, probe->probe.stmts) {
 		err = compile_walk(stmt, prog);
 		if (err)
-			goto err_free;
+			return err;
 
 		if (!stmt->next)
 			break;
 	}
-	
-	if (stmt->type == TYPE_RETURN)
+
+	compile_end(stmt, prog);
+
+	err = compile_subprogs(prog);
+	if (err)
+		return err;
+
+	if (prog->err)
+		return prog->err;
+
+	return peephole(prog);
+}
+
+/* values never live across statements, so a probe can be cut at any
+ * statement boundary. each part is filled with as many statements as
+ * will fit and then tail calls the next one. registers and the stack
+ * do not survive a tail call, so each part sets up the context and
+ * scratch pointers again. */
+static prog_t *compile_split(node_t *probe)
+{
+	prog_t *head, *prog;
+	node_t *stmt, *last = NULL;
+	size_t mark, start;
+	int err, fd, tails = 0;
+
+	if (G.dump)
+		fd = 0xfc00;
+	else
+		fd = bpf_map_create(BPF_MAP_TYPE_PROG_ARRAY, sizeof(uint32_t),
+				    sizeof(uint32_t), PROG_TAILS_MAX);
+	if (fd < 0) {
+		_pe("%s: unable to create program array", probe->string);
+		return NULL;
+	}
+
+	head = prog = prog_new(1);
+	head->tail_fd = fd;
+
+	err = compile_head(probe, prog, 1);
+	if (err)
+		goto err_free;
+
+	err = compile_pred(probe->probe.pred, prog);
+	if (err)
+		goto err_free;
+
+	start = prog->ip - prog->insns;
+	for (stmt = probe->probe.stmts; stmt;) {
+		mark = prog->ip - prog->insns;
+
+		err = compile_walk(stmt, prog);
+		if (err)
+			goto err_free;
+
+		if ((prog->ip - prog->insns) + TAIL_CALL_INSNS <= BPF_MAXINSNS) {
+			last = stmt;
+			stmt = stmt->next;
+			continue;
+		}
+
+		if (mark == start) {
+			_e("%s: %s does not fit in a single program",
+			   probe->string, node_str(stmt));
+			err = -E2BIG;
+			goto err_free;
+		}
+
+		if (tails == PROG_TAILS_MAX) {
+			_e("%s: does not fit in %d chained programs",
+			   probe->string, PROG_TAILS_MAX + 1);
+			err = -E2BIG;
+			goto err_free;
+		}
+
+		/* drop the statement, chain to a new part and compile
+		 * it again over there. */
+		prog->ip = prog->insns + mark;
+		compile_tail_call(prog, fd, tails++);
+
+		prog->next = prog_new(1);
+		prog = prog->next;
+
+		err = compile_head(probe, prog, 0);
+		if (err)
+			goto err_free;
+
+		start = prog->ip - prog->insns;
+	}
+
+	compile_end(last, prog);
+
+	for (prog = head; prog; prog = prog->next) {
+		err = peephole(prog);
+		if (err)
+			goto err_free;
+	}
+
+	_d("%s: split into %d programs", probe->string, tails + 1);
+	return head;
+
+err_free:
+	prog_free(head);
+	return NULL;
+}
+
+prog_t *compile_probe(node_t *probe)
+{
+	prog_t *prog;
+	int err;
+
+	_d("");
+
+	prog = prog_new(0);
+	err = compile_whole(probe, prog);
+	if (err)
+		goto err_free;
+
+	if (prog->ip - prog->insns <= BPF_MAXINSNS)
 		return prog;
 
-	emit(prog, MOV_IMM(BPF_REG_0, 0));
-	emit(prog, EXIT);
-	return prog;
+	_d("%s: %zu instructions, splitting", probe->string,
+	   prog->ip - prog->insns);
+	prog_free(prog);
+	return compile_split(probe);
 
 err_free:
-	free(prog);
+	prog_free(prog);
 	return NULL;
 }
+
+static void prog_stats(node_t *probe, prog_t *prog, int part, uint64_t ns)
+{
+	struct bpf_prog_info info;
+
+	if (bpf_prog_info(prog->fd, &info)) {
+		_pe("%s: unable to get program info", probe->string);
+		return;
+	}
+
+	fprintf(stderr, "%s", probe->string);
+	if (prog->split)
+		fprintf(stderr, "/%d", part);
+
+	fprintf(stderr, ": %zu insns, ", prog->ip - prog->insns);
+
+	/* verified_insns is only reported by 5.16 and later */
+#ifdef HAVE_STRUCT_BPF_PROG_INFO_VERIFIED_INSNS
+	fprintf(stderr, "%u verified ", info.verified_insns);
+#endif
+	fprintf(stderr, "in %" PRIu64 " us, %u bytes jited\n",
+		ns / 1000, info.jited_prog_len);
+}
+
+static int prog_load_one(node_t *probe, prog_t *prog,
+			 enum bpf_prog_type type, int part)
+{
+	struct timespec start, end;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	prog->fd = bpf_prog_load(type, prog->insns, prog->ip - prog->insns);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (prog->fd < 0 || !G.stats)
+		return prog->fd;
+
+	ns  = (end.tv_sec - start.tv_sec) * 1000000000ULL;
+	ns += end.tv_nsec - start.tv_nsec;
+	prog_stats(probe, prog, part, ns);
+	return prog->fd;
+}
+
+/* load all parts of a probe, returns the fd of the first one, which
+ * is the one to attach. */
+int prog_load(node_t *probe, prog_t *prog, enum bpf_prog_type type)
+{
+	prog_t *part;
+	uint32_t index = 0;
+	int fd;
+
+	for (part = prog->next; part; part = part->next, index++) {
+		fd = prog_load_one(probe, part, type, index + 1);
+		if (fd < 0)
+			return fd;
+
+		if (bpf_map_update(prog->tail_fd, &index, &fd, BPF_ANY))
+			return -1;
+	}
+
+	return prog_load_one(probe, prog, type, 0);
+}
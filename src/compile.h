@@ -43,22 +43,81 @@
 #define ALU(_op, _dst, _src)     INSN(BPF_ALU64 | BPF_OP((_op)) | BPF_X, _dst, _src, 0, 0)
 #define ALU_IMM(_op, _dst, _imm) INSN(BPF_ALU64 | BPF_OP((_op)) | BPF_K, _dst, 0, 0, _imm)
 
+#define BE64(_dst) INSN(BPF_ALU | BPF_END | BPF_TO_BE, _dst, 0, 0, 64)
+
 #define STW_IMM(_dst, _off, _imm) INSN(BPF_ST  | BPF_SIZE(BPF_W)  | BPF_MEM, _dst, 0, _off, _imm)
+#define STXB(_dst, _off, _src)    INSN(BPF_STX | BPF_SIZE(BPF_B)  | BPF_MEM, _dst, _src, _off, 0)
 #define STXDW(_dst, _off, _src)   INSN(BPF_STX | BPF_SIZE(BPF_DW) | BPF_MEM, _dst, _src, _off, 0)
+#define XADDDW(_dst, _off, _src)  INSN(BPF_STX | BPF_SIZE(BPF_DW) | BPF_XADD, _dst, _src, _off, 0)
 
 #define LDXB(_dst, _off, _src)  INSN(BPF_LDX | BPF_SIZE(BPF_B)  | BPF_MEM, _dst, _src, _off, 0)
 #define LDXDW(_dst, _off, _src) INSN(BPF_LDX | BPF_SIZE(BPF_DW) | BPF_MEM, _dst, _src, _off, 0)
 
+#ifndef BPF_PSEUDO_CALL
+#define BPF_PSEUDO_CALL 1
+#endif
+
+#ifndef BPF_PSEUDO_MAP_VALUE
+#define BPF_PSEUDO_MAP_VALUE 2
+#endif
+
+#define SUBPROG_CALLS_MAX 64
+
+struct prog;
+
+/* a sequence that is emitted once, after the main program, and
+ * reached via BPF_PSEUDO_CALL. like helpers, arguments are passed in
+ * r1-r5 and the result is returned in r0. */
+typedef struct subprog {
+	const char *name;
+	int (*emit)(struct prog *prog, node_t *call);
+} subprog_t;
+
+typedef struct subprog_call {
+	const subprog_t *sub;
+	node_t *call;
+	size_t  at;
+} subprog_call_t;
+
+/* hard limit on the number of instructions emitted for one probe,
+ * matches the verifier's complexity limit. */
+#define PROG_INSNS_MAX (1 << 20)
+
+/* probes larger than BPF_MAXINSNS are split into a chain of programs
+ * linked by tail calls, which the kernel limits to this depth. */
+#define PROG_TAILS_MAX 32
+
 typedef struct prog {
 	struct bpf_insn *ip;
-	struct bpf_insn  insns[BPF_MAXINSNS];
+	struct bpf_insn *insns;
+	size_t cap;
+	int err;
 
 	ssize_t sp;
 	node_t *regs[__MAX_BPF_REG];
+
+	subprog_call_t calls[SUBPROG_CALLS_MAX];
+	int n_calls;
+
+	/* set on all parts of a split probe, next points to the part
+	 * that is tail called at the end of this one. */
+	int split;
+	int tail_fd;
+	struct prog *next;
+
+	/* set once loaded */
+	int fd;
 } prog_t;
 
 extern const dyn_t dyn_reg[];
 
+/* stack addresses are negative offsets from the frame pointer,
+ * scratch addresses are positive offsets into the scratch buffer. */
+static inline int mem_base(ssize_t addr)
+{
+	return addr < 0 ? BPF_REG_10 : SCRATCH_REG;
+}
+
 void emit           (prog_t *prog, struct bpf_insn insn);
 int  emit_stack_zero(prog_t *prog, const node_t *n);
 int  emit_xfer_dyns (prog_t *prog, const dyn_t  *to, const dyn_t  *from);
@@ -72,8 +131,44 @@ static inline void emit_ld_mapfd(prog_t *prog, int reg, int fd)
 	emit(prog, INSN(0, 0, 0, 0, 0));
 }
 
+/* pointer to offset `off` in the value of the first element of an
+ * array map (5.2+) */
+static inline void emit_ld_mapvalue(prog_t *prog, int reg, int fd, int off)
+{
+	emit(prog, INSN(BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_VALUE, 0, fd));
+	emit(prog, INSN(0, 0, 0, 0, off));
+}
+
+static inline void emit_ld_imm64(prog_t *prog, int reg, uint64_t imm)
+{
+	emit(prog, INSN(BPF_LD | BPF_DW | BPF_IMM, reg, 0, 0, (uint32_t)imm));
+	emit(prog, INSN(0, 0, 0, 0, imm >> 32));
+}
+
+int emit_subprog_call(prog_t *prog, const subprog_t *sub, node_t *call);
+
+/* only worth the call overhead, and the dependency on bpf-to-bpf
+ * calls (4.16), when a sequence is used more than once. tail calls
+ * can not be mixed with bpf-to-bpf calls on older kernels, so split
+ * probes always inline. */
+static inline int subprog_shared(prog_t *prog, node_t *call)
+{
+	if (prog->split)
+		return 0;
+
+	return node_probe_call_count(node_get_probe(call), call->string) > 1;
+}
+
 int emit_log2_raw      (prog_t *prog, int dst, int src);
-int emit_map_update_raw(prog_t *prog, int fd, ssize_t key, ssize_t val);
+int emit_map_update_raw(prog_t *prog, int fd, ssize_t key, ssize_t val,
+			int flags);
+int emit_map_delete_raw(prog_t *prog, int fd, ssize_t key);
 int emit_map_lookup_raw(prog_t *prog, int fd, ssize_t addr);
+int emit_scalar_addr   (prog_t *prog, int reg, node_t *map);
+
+void dump_insn(struct bpf_insn insn, size_t ip);
 
+int     peephole     (prog_t *prog);
 prog_t *compile_probe(node_t *probe);
+void    prog_free    (prog_t *prog);
+int     prog_load    (node_t *probe, prog_t *prog, enum bpf_prog_type type);
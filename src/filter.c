@@ -0,0 +1,189 @@
+/*
+ * Copyright 2015-2016 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/bpf.h>
+#include <linux/magic.h>
+
+#include <sys/vfs.h>
+
+#include "ply.h"
+#include "bpf-syscall.h"
+#include "filter.h"
+#include "pvdr/pvdr.h"
+
+/* -p, --cgroup and --comm restrict all probes to a set of tasks. The
+ * checks are placed first in every program, cheapest first, so that
+ * events from unrelated tasks are dropped after only a handful of
+ * instructions. */
+
+static struct {
+	int      pid_fd;
+	uint64_t cgroup_id;
+} filt;
+
+/* cgroup ids, as returned by get_current_cgroup_id, are the kernfs
+ * node id, which is also what is found in a file handle for the
+ * cgroup's directory. */
+static int filter_cgroup_id(const char *path, uint64_t *id)
+{
+	struct {
+		struct file_handle fh;
+		uint64_t id;
+	} h = { .fh.handle_bytes = sizeof(uint64_t) };
+	struct statfs sfs;
+	int mnt;
+
+	if (statfs(path, &sfs) || sfs.f_type != CGROUP2_SUPER_MAGIC) {
+		_e("'%s' is not a cgroup2 directory", path);
+		return -EINVAL;
+	}
+
+	if (name_to_handle_at(AT_FDCWD, path, &h.fh, &mnt, 0)) {
+		_pe("unable to resolve cgroup '%s'", path);
+		return -errno;
+	}
+
+	*id = h.id;
+	return 0;
+}
+
+int filter_setup(node_t *script)
+{
+	uint32_t tgid;
+	uint8_t one = 1;
+	int err, i;
+
+	if (G.cgroup) {
+		err = filter_cgroup_id(G.cgroup, &filt.cgroup_id);
+		if (err)
+			return err;
+	}
+
+	/* a single pid is compared against an immediate, larger sets
+	 * are looked up in a hash. */
+	if (G.n_pids < 2)
+		return 0;
+
+	if (G.dump) {
+		filt.pid_fd = 0xfe00;
+		return 0;
+	}
+
+	filt.pid_fd = bpf_map_create(BPF_MAP_TYPE_HASH, sizeof(tgid),
+				     sizeof(one), G.n_pids);
+	if (filt.pid_fd < 0) {
+		_pe("failed creating pid filter map");
+		return filt.pid_fd;
+	}
+
+	for (i = 0; i < G.n_pids; i++) {
+		tgid = G.pids[i];
+		if (bpf_map_update(filt.pid_fd, &tgid, &one, BPF_ANY)) {
+			_pe("unable to add pid %d to filter", G.pids[i]);
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+static void filter_exit_unless(prog_t *prog, struct bpf_insn jmp)
+{
+	jmp.off = 2;
+	emit(prog, jmp);
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, EXIT);
+}
+
+static void filter_compile_pid(prog_t *prog)
+{
+	ssize_t key = -(ssize_t)sizeof(uint32_t);
+
+	emit(prog, CALL(BPF_FUNC_get_current_pid_tgid));
+	emit(prog, ALU_IMM(ALU_OP_RSH, BPF_REG_0, 32));
+
+	if (G.n_pids == 1) {
+		filter_exit_unless(prog, JMP_IMM(JMP_JEQ, BPF_REG_0, G.pids[0], 0));
+		return;
+	}
+
+	emit(prog, INSN(BPF_STX | BPF_SIZE(BPF_W) | BPF_MEM,
+			BPF_REG_10, BPF_REG_0, key, 0));
+	emit_map_lookup_raw(prog, filt.pid_fd, key);
+	filter_exit_unless(prog, JMP_IMM(JMP_JNE, BPF_REG_0, 0, 0));
+}
+
+static void filter_compile_cgroup(prog_t *prog)
+{
+	emit(prog, CALL(BPF_FUNC_get_current_cgroup_id));
+	emit_ld_imm64(prog, BPF_REG_1, filt.cgroup_id);
+	filter_exit_unless(prog, JMP(JMP_JEQ, BPF_REG_0, BPF_REG_1, 0));
+}
+
+static void filter_compile_comm(prog_t *prog)
+{
+	uint64_t want[2] = { 0, 0 };
+	ssize_t buf = -(ssize_t)sizeof(want);
+	size_t i;
+
+	strncpy((char *)want, G.comm, sizeof(want) - 1);
+
+	/* older kernels do not pad the comm with zeroes */
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, STXDW(BPF_REG_10, buf, BPF_REG_0));
+	emit(prog, STXDW(BPF_REG_10, buf + sizeof(uint64_t), BPF_REG_0));
+
+	emit(prog, MOV(BPF_REG_1, BPF_REG_10));
+	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_1, buf));
+	emit(prog, MOV_IMM(BPF_REG_2, sizeof(want)));
+	emit(prog, CALL(BPF_FUNC_get_current_comm));
+
+	for (i = 0; i < 2; i++) {
+		emit(prog, LDXDW(BPF_REG_0, buf + i * sizeof(uint64_t), BPF_REG_10));
+		emit_ld_imm64(prog, BPF_REG_1, want[i]);
+		filter_exit_unless(prog, JMP(JMP_JEQ, BPF_REG_0, BPF_REG_1, 0));
+	}
+}
+
+void filter_compile(node_t *probe, prog_t *prog)
+{
+	const char *pvdr = node_get_pvdr(probe)->name;
+
+	/* BEGIN and END run in ply's own context, interval fires on
+	 * a single CPU in whatever task happens to be running. */
+	if (!strcmp(pvdr, "BEGIN") || !strcmp(pvdr, "END") ||
+	    !strcmp(pvdr, "interval"))
+		return;
+
+	if (G.n_pids)
+		filter_compile_pid(prog);
+
+	if (G.cgroup)
+		filter_compile_cgroup(prog);
+
+	if (G.comm)
+		filter_compile_comm(prog);
+}
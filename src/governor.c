@@ -0,0 +1,219 @@
+/*
+ * Copyright 2015-2016 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/bpf.h>
+
+#include "ply.h"
+#include "bpf-syscall.h"
+#include "governor.h"
+#include "stats.h"
+#include "pvdr/pvdr.h"
+
+/* Keeps the CPU time spent in probes below --max-overhead. Every
+ * probe starts with a check against a per-probe threshold in the
+ * governor map, events where a random number falls below it are
+ * dropped. When the budget is exceeded, the most expensive probe
+ * has its sampling rate halved. Once it is down to one in
+ * 2^GOV_LEVEL_MAX events, it is detached instead. */
+
+#define GOV_LEVEL_MAX 10
+
+typedef struct gov_probe {
+	node_t  *probe;
+	uint64_t ns;
+	int      level;
+	int      detached;
+	int      exempt;
+} gov_probe_t;
+
+static struct {
+	int fd;
+	int ncpus;
+	int n_probes;
+	gov_probe_t *probes;
+
+	struct timespec last;
+} gov;
+
+static int governor_key(node_t *probe)
+{
+	int i;
+
+	for (i = 0; i < gov.n_probes; i++) {
+		if (gov.probes[i].probe == probe)
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+int governor_setup(node_t *script)
+{
+	node_t *probe;
+
+	if (!G.max_overhead)
+		return 0;
+
+	node_foreach(probe, script->script.probes)
+		gov.n_probes++;
+
+	gov.probes = calloc(gov.n_probes, sizeof(*gov.probes));
+	assert(gov.probes);
+
+	gov.n_probes = 0;
+	node_foreach(probe, script->script.probes)
+		gov.probes[gov.n_probes++].probe = probe;
+
+	gov.ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (G.dump) {
+		gov.fd = 0xfb00;
+		return 0;
+	}
+
+	gov.fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+				sizeof(uint32_t), gov.n_probes);
+	if (gov.fd < 0) {
+		_pe("failed creating governor map");
+		return gov.fd;
+	}
+
+	return 0;
+}
+
+void governor_compile(node_t *probe, prog_t *prog)
+{
+	ssize_t key = -(ssize_t)sizeof(uint32_t);
+
+	if (!G.max_overhead)
+		return;
+
+	emit(prog, STW_IMM(BPF_REG_10, key, governor_key(probe)));
+	emit_map_lookup_raw(prog, gov.fd, key);
+	emit(prog, JMP_IMM(JMP_JEQ, BPF_REG_0, 0, 5));
+	emit(prog, INSN(BPF_LDX | BPF_SIZE(BPF_W) | BPF_MEM,
+			BPF_REG_6, BPF_REG_0, 0, 0));
+	emit(prog, CALL(BPF_FUNC_get_prandom_u32));
+	emit(prog, JMP(JMP_JGE, BPF_REG_0, BPF_REG_6, 2));
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, EXIT);
+}
+
+static void governor_set(gov_probe_t *gp, int level)
+{
+	uint32_t key = gp - gov.probes, drop;
+
+	gp->level = level;
+	drop = UINT32_MAX - (UINT32_MAX >> level);
+
+	if (bpf_map_update(gov.fd, &key, &drop, BPF_ANY))
+		_pe("%s: unable to update sampling rate", gp->probe->string);
+}
+
+static void governor_detach(gov_probe_t *gp, double pct)
+{
+	pvdr_t *pvdr = node_get_pvdr(gp->probe);
+
+	/* e.g. BEGIN and END, leave them at the lowest sampling rate
+	 * and let the governor move on to other probes. */
+	if (!pvdr->detach) {
+		gp->exempt = 1;
+		_i("%s: overhead %.2f%%, unable to detach", gp->probe->string,
+		   pct);
+		return;
+	}
+
+	if (pvdr->detach(gp->probe)) {
+		_pe("%s: unable to detach", gp->probe->string);
+		return;
+	}
+
+	gp->detached = 1;
+	_i("%s: overhead %.2f%%, detached", gp->probe->string, pct);
+}
+
+void governor_tick(node_t *script)
+{
+	gov_probe_t *gp, *worst = NULL;
+	struct timespec now;
+	uint64_t cnt, ns, delta, total = 0, worst_delta = 0, elapsed;
+	double pct;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed  = (now.tv_sec - gov.last.tv_sec) * 1000000000ULL;
+	elapsed += now.tv_nsec - gov.last.tv_nsec;
+
+	for (gp = gov.probes; gp < &gov.probes[gov.n_probes]; gp++) {
+		if (!gp->probe->dyn.probe.prog ||
+		    stats_probe(gp->probe, &cnt, &ns))
+			continue;
+
+		delta = ns - gp->ns;
+		gp->ns = ns;
+
+		total += delta;
+		if (!gp->detached && !gp->exempt && delta > worst_delta) {
+			worst = gp;
+			worst_delta = delta;
+		}
+	}
+
+	/* the first sample only sets the baseline */
+	if (!gov.last.tv_sec) {
+		gov.last = now;
+		return;
+	}
+	gov.last = now;
+
+	pct = (100.0 * total) / ((double)elapsed * gov.ncpus);
+	if (pct <= G.max_overhead) {
+		/* comfortably within budget, back off on the sampling
+		 * of the throttled probes. */
+		if (pct > G.max_overhead / 2)
+			return;
+
+		for (gp = gov.probes; gp < &gov.probes[gov.n_probes]; gp++) {
+			if (gp->detached || gp->exempt || !gp->level)
+				continue;
+
+			governor_set(gp, gp->level - 1);
+			_i("%s: overhead %.2f%%, sampling 1 in %d events",
+			   gp->probe->string, pct, 1 << gp->level);
+		}
+		return;
+	}
+
+	if (!worst)
+		return;
+
+	if (worst->level == GOV_LEVEL_MAX) {
+		governor_detach(worst, pct);
+		return;
+	}
+
+	governor_set(worst, worst->level + 1);
+	_i("%s: overhead %.2f%%, sampling 1 in %d events",
+	   worst->probe->string, pct, 1 << worst->level);
+}
@@ -51,6 +51,8 @@ const char *loc_str(loc_t loc)
 		return "reg";
 	case LOC_STACK:
 		return "stack";
+	case LOC_SCRATCH:
+		return "scratch";
 	}
 
 	return "UNKNOWN";
@@ -146,6 +148,9 @@ static int _node_ast_dump(node_t *n, void *indent)
 	case LOC_STACK:
 		fprintf(stderr, "/-0x%zx", -n->dyn.addr);
 		break;
+	case LOC_SCRATCH:
+		fprintf(stderr, "/+0x%zx", n->dyn.addr);
+		break;
 	}
 
 	fputs(")\n", stderr);
@@ -213,24 +218,208 @@ int node_map_get_fd(node_t *map)
 	return mdyn ? mdyn->mapfd : -ENOENT;
 }
 
-int node_stmt_reg_get(node_t *stmt)
+/* a plain $var, i.e. one that has not been keyed by a method like
+ * quantize(), has exactly one value and can live in an array slot. */
+int node_map_is_scalar(node_t *map)
 {
-	int reg;
+	return map->type == TYPE_MAP && map->map.is_var &&
+		map->map.rec->rec.n_vargs == 1;
+}
 
-	for (reg = BPF_REG_6; reg < BPF_REG_9; reg++) {
-		if (stmt->dyn.free_regs & (1 << reg)) {
-			stmt->dyn.free_regs &= ~(1 << reg);
-			return reg;
-		}
+struct call_query {
+	const char *func;
+	int count;
+};
+
+static int _node_call_count(node_t *n, void *_q)
+{
+	struct call_query *q = _q;
+
+	if (n->type == TYPE_CALL && !strcmp(n->string, q->func))
+		q->count++;
+
+	return 0;
+}
+
+int node_probe_call_count(node_t *probe, const char *func)
+{
+	struct call_query q = { .func = func };
+
+	node_walk(probe, _node_call_count, NULL, &q);
+	return q.count;
+}
+
+struct reg_query {
+	node_t *n;
+	int from, to;
+
+	int busy;
+	int clobbered;
+};
+
+/* a value is live from the point where it is produced until it is
+ * consumed by its parent. values produced directly by statements are
+ * never consumed. */
+static int node_live_end(node_t *n)
+{
+	if (!n->parent || n->parent->type == TYPE_PROBE)
+		return n->dyn.seq;
+
+	return n->parent->dyn.seq;
+}
+
+static int _node_reg_query(node_t *m, void *_q)
+{
+	struct reg_query *q = _q;
+
+	/* helper calls etc. within the live range */
+	if (m->dyn.seq > q->from && m->dyn.seq <= q->to)
+		q->clobbered |= m->dyn.clobber_regs;
+
+	if (m == q->n || m->dyn.loc != LOC_REG)
+		return 0;
+
+	/* overlapping live ranges */
+	if (q->from < node_live_end(m) && m->dyn.seq < q->to)
+		q->busy |= 1 << m->dyn.reg;
+
+	return 0;
+}
+
+int node_probe_reg_get(node_t *probe, node_t *n, int hint)
+{
+	static const int order[] = {
+		BPF_REG_2, BPF_REG_3, BPF_REG_4,
+		BPF_REG_6, BPF_REG_7, BPF_REG_8,
+	};
+	struct reg_query q = { .n = n };
+	int i, avail;
+
+	q.from = n->dyn.seq;
+	q.to   = node_live_end(n);
+	node_walk(probe, _node_reg_query, NULL, &q);
+
+	avail  = (TMP_REGS & ~q.clobbered) | DYN_REGS;
+	avail &= ~q.busy;
+
+	if (probe->dyn.probe.scratch_reg)
+		avail &= ~(1 << probe->dyn.probe.scratch_reg);
+
+	if (hint >= 0 && (avail & (1 << hint)))
+		return hint;
+
+	for (i = 0; i < (int)(sizeof(order) / sizeof(order[0])); i++) {
+		if (avail & (1 << order[i]))
+			return order[i];
 	}
 
 	return -1;
 }
 
-ssize_t node_probe_stack_get(node_t *probe, size_t size)
+static int _node_first_seq(node_t *m, void *_first)
 {
-	probe->dyn.probe.sp -= size;
-	return probe->dyn.probe.sp;
+	int *first = _first;
+
+	if (m->dyn.seq < *first)
+		*first = m->dyn.seq;
+	return 0;
+}
+
+/* stack data may be written by any node below n, and is consumed by
+ * n's parent. map keys are also used by whoever consumes the map,
+ * e.g. to update the value. */
+static void node_stack_live_range(node_t *n, int *from, int *to)
+{
+	*from = n->dyn.seq;
+	node_walk(n, _node_first_seq, NULL, from);
+
+	if (n->parent && n->parent->type == TYPE_MAP)
+		*to = node_live_end(n->parent);
+	else
+		*to = node_live_end(n);
+}
+
+static int slot_collides(slot_t *s, ssize_t addr, size_t size,
+			 int from, int to)
+{
+	if (s->to < from || to < s->from)
+		return 0;
+
+	return addr < s->addr + (ssize_t)s->size &&
+		s->addr < addr + (ssize_t)size;
+}
+
+/* first fit, starting from the top of the frame. the only candidates
+ * are the top itself and the spots just below each existing slot
+ * whose live range overlaps with the new one. */
+ssize_t node_probe_stack_get(node_t *probe, node_t *n, size_t size)
+{
+	slot_t *slots = probe->dyn.probe.slots;
+	int i, j, n_slots = probe->dyn.probe.n_slots;
+	int from, to;
+	ssize_t addr, best = 0;
+
+	size = _ALIGNED(size);
+	node_stack_live_range(n, &from, &to);
+
+	for (i = -1; i < n_slots; i++) {
+		if (i < 0)
+			addr = -(ssize_t)size;
+		else if (slots[i].to < from || to < slots[i].from)
+			continue;
+		else
+			addr = slots[i].addr - size;
+
+		if (best && addr <= best)
+			continue;
+
+		for (j = 0; j < n_slots; j++) {
+			if (slot_collides(&slots[j], addr, size, from, to))
+				break;
+		}
+
+		if (j == n_slots)
+			best = addr;
+	}
+
+	slots = realloc(slots, (n_slots + 1) * sizeof(*slots));
+	assert(slots);
+
+	slots[n_slots] = (slot_t) {
+		.addr = best, .size = size, .from = from, .to = to
+	};
+	probe->dyn.probe.slots = slots;
+	probe->dyn.probe.n_slots++;
+
+	if (best < probe->dyn.probe.sp)
+		probe->dyn.probe.sp = best;
+
+	return best;
+}
+
+/* place n in memory. the stack is preferred, but large values, and
+ * anything that would overflow the frame, go to the scratch buffer
+ * instead. */
+void node_probe_mem_get(node_t *probe, node_t *n, size_t size)
+{
+	ssize_t sp = probe->dyn.probe.sp;
+
+	if (size <= STACK_VAL_MAX) {
+		n->dyn.loc  = LOC_STACK;
+		n->dyn.addr = node_probe_stack_get(probe, n, size);
+		if (n->dyn.addr >= -STACK_MAX)
+			return;
+
+		/* give back the slot */
+		probe->dyn.probe.n_slots--;
+		probe->dyn.probe.sp = sp;
+	}
+
+	/* scratch addresses are positive offsets into the buffer,
+	 * which keeps them apart from stack addresses. */
+	n->dyn.loc  = LOC_SCRATCH;
+	n->dyn.addr = probe->dyn.probe.scratch;
+	probe->dyn.probe.scratch += _ALIGNED(size);
 }
 
 static inline node_t *node_new(type_t type) {
@@ -405,6 +594,22 @@ node_t *node_binop_new(node_t *left, char *opstr, node_t *right)
 	return n;
 }
 
+/* `expr in $set` is a call to in() on the map $set, indexed by
+ * expr. a record literal is used as the key as is. */
+node_t *node_in_new(node_t *expr, char *set)
+{
+	node_t *rec = (expr->type == TYPE_REC) ? expr : node_rec_new(expr);
+
+	return node_call_new(strdup("in"), node_map_new(set, rec));
+}
+
+/* `expr ~ pattern` is a call to match(expr, pattern) */
+node_t *node_match_new(node_t *expr, node_t *pattern)
+{
+	insque_tail(pattern, expr);
+	return node_call_new(strdup("match"), expr);
+}
+
 node_t *node_method_new(node_t *map, node_t *call)
 {
 	node_t *n = node_new(TYPE_METHOD);
@@ -31,7 +31,22 @@
 #define _ALIGN sizeof(int64_t)
 #define _ALIGNED(_size) (((_size) + _ALIGN - 1) & ~(_ALIGN - 1))
 
+/* registers available to the allocator. callee saved registers are
+ * preserved across helper calls, caller saved ones may only hold
+ * values whose live range does not cross a node that clobbers them.
+ * r0, r1 and r5 are reserved as scratch registers for the emitters. */
 #define DYN_REGS ((1 << BPF_REG_6) | (1 << BPF_REG_7) | (1 << BPF_REG_8))
+#define TMP_REGS ((1 << BPF_REG_2) | (1 << BPF_REG_3) | (1 << BPF_REG_4))
+
+#define CALLER_REGS ((1 << BPF_REG_0) | (1 << BPF_REG_1) | (1 << BPF_REG_2) | \
+		     (1 << BPF_REG_3) | (1 << BPF_REG_4) | (1 << BPF_REG_5))
+
+/* the BPF stack is limited to 512 bytes. large values, and anything
+ * that does not fit in the frame, are instead placed in a per-CPU
+ * scratch buffer whose address is kept in SCRATCH_REG. */
+#define STACK_MAX     512
+#define STACK_VAL_MAX 128
+#define SCRATCH_REG   BPF_REG_8
 
 static inline void insque_tail(void *elem, void *prev)
 {
@@ -152,15 +167,42 @@ struct mdyn {
 	node_t *map;
 	int     mapfd;
 
+	/* scalar value can be addressed without a lookup */
+	int     direct;
+	/* scalar value mapped into our memory, if supported */
+	void   *mem;
+
+	/* preloaded with --set, possibly as a bloom filter */
+	int     set;
+	int     bloom;
+
+	/* the aggregation shown for maps of stats(), sum() etc. */
+	int     agg;
+
+	/* candidates for the top k keys, counted in a sketch at
+	 * topk_off in the shared "topk" map */
+	int     topk;
+	size_t  topk_off;
+	mdyn_t *topk_sketch;
+
 	mdumper_t dump;
 	cmper_t   cmp;
 };
 
+/* a stack allocation, and the range of sequence numbers during
+ * which it is in use. */
+typedef struct slot {
+	ssize_t addr;
+	size_t  size;
+	int     from, to;
+} slot_t;
+
 typedef enum loc {
 	LOC_NOWHERE,
 	LOC_VIRTUAL,
 	LOC_REG,
 	LOC_STACK,
+	LOC_SCRATCH,
 } loc_t;
 
 struct dyn {
@@ -171,7 +213,10 @@ struct dyn {
 	int     reg;
 	ssize_t addr;
 
-	int     free_regs;
+	/* position in evaluation order, and the registers destroyed
+	 * by the code generated for this node. */
+	int     seq;
+	int     clobber_regs;
 
 	union {
 		struct {
@@ -179,6 +224,16 @@ struct dyn {
 			void   *pvdr_priv;
 
 			ssize_t sp;
+			slot_t *slots;
+			int     n_slots;
+
+			size_t  scratch;
+			int     scratch_reg;
+
+			/* once loaded, and the number of events it is
+			 * attached to */
+			struct prog *prog;
+			int     n_events;
 		} probe;
 
 		struct {
@@ -237,10 +292,13 @@ pvdr_t *node_get_pvdr  (node_t *n);
 node_t *node_get_probe (node_t *n);
 node_t *node_get_script(node_t *n);
 
-mdyn_t *node_map_get_mdyn   (node_t *map);
-int     node_map_get_fd     (node_t *map);
-int     node_stmt_reg_get   (node_t *stmt);
-ssize_t node_probe_stack_get(node_t *probe, size_t size);
+mdyn_t *node_map_get_mdyn    (node_t *map);
+int     node_map_get_fd      (node_t *map);
+int     node_map_is_scalar   (node_t *map);
+int     node_probe_call_count(node_t *probe, const char *func);
+int     node_probe_reg_get   (node_t *probe, node_t *n, int hint);
+ssize_t node_probe_stack_get (node_t *probe, node_t *n, size_t size);
+void    node_probe_mem_get   (node_t *probe, node_t *n, size_t size);
 
 node_t *node_str_new     (char *val);
 node_t *node_int_new     (int64_t val);
@@ -250,6 +308,8 @@ node_t *node_var_new     (char *name);
 node_t *node_not_new     (node_t *expr);
 node_t *node_return_new  (node_t *expr);
 node_t *node_binop_new   (node_t *left, char *opstr, node_t *right);
+node_t *node_in_new      (node_t *expr, char *set);
+node_t *node_match_new   (node_t *expr, node_t *pattern);
 node_t *node_assign_new  (node_t *lval, char *opstr, node_t *expr);
 node_t *node_method_new  (node_t *map, node_t *call);
 node_t *node_call_new    (char *func, node_t *vargs);
@@ -57,14 +57,19 @@ typedef struct node node_t;
 %parse-param { node_t **script }
 %parse-param { yyscan_t scanner }
 
-%token NIL RETURN
-%token <string> PSPEC IDENT UIDENT STRING OP AOP
+%token NIL RETURN IN
+%token <string> PSPEC IDENT UIDENT STRING AOP
+%token <string> BITOP CMP SHIFT ADD MUL
 %token <integer> INT
 
 %type <node> script probes probe stmts stmt
 %type <node> block expr variable record call vargs
 
-%left OP
+%left BITOP
+%left CMP IN '~'
+%left SHIFT
+%left ADD
+%left MUL
 %precedence '!'
 
 %start script
@@ -117,7 +122,19 @@ expr : INT
 		{ $$ = node_str_new($1); }
      | record
 		{ $$ = $1; }
-     | expr OP expr
+     | expr BITOP expr
+     		{ $$ = node_binop_new($1, $2, $3); }
+     | expr CMP expr
+     		{ $$ = node_binop_new($1, $2, $3); }
+     | expr IN UIDENT
+     		{ $$ = node_in_new($1, $3); }
+     | expr '~' expr
+     		{ $$ = node_match_new($1, $3); }
+     | expr SHIFT expr
+     		{ $$ = node_binop_new($1, $2, $3); }
+     | expr ADD expr
+     		{ $$ = node_binop_new($1, $2, $3); }
+     | expr MUL expr
      		{ $$ = node_binop_new($1, $2, $3); }
      | '!' expr
 		{ $$ = node_not_new($2); }
@@ -23,63 +23,174 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <linux/perf_event.h>
+
+#include <sys/mman.h>
+
 #include "ply.h"
 #include "bpf-syscall.h"
+#include "compile.h"
 #include "map.h"
 
 static void dump_node(FILE *fp, node_t *n, void *data);
 
-void dump_sym(FILE *fp, node_t *integer, void *data)
+typedef struct ksym {
+	uint64_t addr;
+	char    *name;
+} ksym_t;
+
+static struct {
+	int     loaded;
+	size_t  len;
+	ksym_t *syms;
+} ksyms;
+
+static int ksym_cmp(const void *_a, const void *_b)
 {
-	uint64_t *target = data;
-	FILE *ksyms;
-	char *pos, *line[2];
-	uint64_t addr[2] = { ULLONG_MAX, ULLONG_MAX };
-	int i = 0;
+	const ksym_t *a = _a, *b = _b;
+
+	if (a->addr < b->addr)
+		return -1;
+
+	return a->addr > b->addr;
+}
+
+static void ksyms_load(void)
+{
+	FILE *fp;
+	char *line, *name, *end;
+	size_t cap = 0x1000;
+	uint64_t addr;
 
-	line[0] = malloc(256);
-	line[1] = malloc(256);
-	assert(line[0] && line[1]);
+	ksyms.loaded = 1;
 
-	ksyms = fopen("/proc/kallsyms", "r");
-	if (!ksyms) {
+	fp = fopen("/proc/kallsyms", "r");
+	if (!fp) {
 		_e("unable to read out kernel symbols");
-		goto fallback;
+		return;
 	}
 
-	for (i = 0; fgets(line[i], 256, ksyms); i = !i) {
-		addr[i] = strtoull(line[i], NULL, 16);
-		if (addr[i] == ULLONG_MAX)
-			goto fallback;
+	line = malloc(256);
+	ksyms.syms = malloc(cap * sizeof(*ksyms.syms));
+	assert(line && ksyms.syms);
 
-		if (addr[i] == *target)
-			break;
+	while (fgets(line, 256, fp)) {
+		addr = strtoull(line, &name, 16);
 
-		if (addr[i] > *target) {
-			i = !i;
-			break;
+		/* a zero address means that kptr_restrict is in
+		 * effect, in which case the table is useless. */
+		if (!addr || addr == ULLONG_MAX)
+			continue;
+
+		/* skip over the symbol type */
+		name = strchr(name + 1, ' ');
+		if (!name)
+			continue;
+
+		name++;
+		end = strpbrk(name, " \t\n");
+		if (end)
+			*end = '\0';
+
+		if (ksyms.len == cap) {
+			cap <<= 1;
+			ksyms.syms = realloc(ksyms.syms, cap * sizeof(*ksyms.syms));
+			assert(ksyms.syms);
 		}
+
+		ksyms.syms[ksyms.len].addr = addr;
+		ksyms.syms[ksyms.len].name = strdup(name);
+		ksyms.len++;
 	}
 
-	pos = strchr(line[i], '\n');
-	if (pos)
-		*pos = '\0';
+	free(line);
+	fclose(fp);
 
-	pos = strrchr(line[i], ' ');
-	if (!pos)
-		goto fallback;
+	qsort(ksyms.syms, ksyms.len, sizeof(*ksyms.syms), ksym_cmp);
+}
 
-	fprintf(fp, "%-20s", pos + 1);
-	fclose(ksyms);
-	return;
+const char *ksym_get(uint64_t addr)
+{
+	size_t lo = 0, hi, mid;
+
+	if (!ksyms.loaded)
+		ksyms_load();
+
+	hi = ksyms.len;
+	if (!hi || addr < ksyms.syms[0].addr)
+		return NULL;
+
+	/* find the last symbol located at or below addr, i.e. the
+	 * function containing it. */
+	while (hi - lo > 1) {
+		mid = lo + ((hi - lo) >> 1);
+
+		if (ksyms.syms[mid].addr <= addr)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return ksyms.syms[lo].name;
+}
+
+void dump_sym(FILE *fp, node_t *integer, void *data)
+{
+	uint64_t *target = data;
+	const char *name;
 
-fallback:
-	if (ksyms)
-		fclose(ksyms);
+	name = ksym_get(*target);
+	if (!name) {
+		fprintf(fp, "<%8" PRIx64 ">", *target);
+		return;
+	}
 
-	fprintf(fp, "<%8" PRIx64 ">", *((int64_t *)data));
+	fprintf(fp, "%-20s", name);
+}
+
+void dump_stack(FILE *fp, node_t *stack, void *data)
+{
+	uint64_t ips[PERF_MAX_STACK_DEPTH];
+	int64_t id = *((int64_t *)data);
+	uint32_t key = id;
+	const char *name;
+	int i, depth;
+
+	memset(ips, 0, sizeof(ips));
+	if (id < 0 || bpf_map_lookup(node_map_get_fd(stack), &key, ips)) {
+		fprintf(fp, "<stack %" PRId64 ">", id);
+		return;
+	}
+
+	for (depth = 0; depth < PERF_MAX_STACK_DEPTH && ips[depth]; depth++);
+
+	if (G.folded) {
+		/* folded stacks, as consumed by flamegraph.pl, are
+		 * listed root first on a single line. */
+		for (i = depth - 1; i >= 0; i--) {
+			name = ksym_get(ips[i]);
+			if (name)
+				fputs(name, fp);
+			else
+				fprintf(fp, "%" PRIx64, ips[i]);
+
+			if (i)
+				fputc(';', fp);
+		}
+		return;
+	}
+
+	for (i = 0; i < depth; i++) {
+		name = ksym_get(ips[i]);
+		if (name)
+			fprintf(fp, "\n\t%s", name);
+		else
+			fprintf(fp, "\n\t<%" PRIx64 ">", ips[i]);
+	}
+	fputc('\n', fp);
 }
 
 static void dump_int(FILE *fp, node_t *integer, void *data)
@@ -202,6 +313,33 @@ int cmp_mdyn(const void *ak, const void *bk, void *_mdyn)
 	return cmp_node(map, av, bv);
 }
 
+/* per-CPU values are returned for every possible CPU, each one
+ * padded to a multiple of 8 bytes */
+void *map_lookup_percpu(int fd, void *key, size_t size, int *n_cpus)
+{
+	FILE *fp;
+	void *vals;
+	int last = 0;
+
+	fp = fopen("/sys/devices/system/cpu/possible", "r");
+	if (fp) {
+		/* e.g. "0-7", the last CPU is what matters */
+		fscanf(fp, "%*d-%d", &last);
+		fclose(fp);
+	}
+
+	*n_cpus = last + 1;
+	vals = calloc(*n_cpus, _ALIGNED(size));
+	assert(vals);
+
+	if (bpf_map_lookup(fd, key, vals)) {
+		free(vals);
+		return NULL;
+	}
+
+	return vals;
+}
+
 static void __key_workaround(int fd, void *key, size_t key_sz, void *val)
 {
 	FILE *fp;
@@ -223,6 +361,72 @@ static void __key_workaround(int fd, void *key, size_t key_sz, void *val)
 	fclose(fp);
 }
 
+/* a scalar is never missing from its array, so an all-zero slot is
+ * taken to mean that it was never assigned. */
+static int scalar_read(mdyn_t *mdyn, void *key, char *val)
+{
+	size_t i, size = mdyn->map->dyn.size;
+
+	if (mdyn->mem)
+		memcpy(val, mdyn->mem, size);
+	else if (bpf_map_lookup(mdyn->mapfd, key, val))
+		return -ENOENT;
+
+	for (i = 0; i < size && !val[i]; i++);
+	return (i == size) ? -ENOENT : 0;
+}
+
+static void dump_scalar(mdyn_t *mdyn)
+{
+	node_t *map = mdyn->map, *rec = map->map.rec;
+	char *key = calloc(1, rec->dyn.size + map->dyn.size);
+	char *val = key + rec->dyn.size;
+
+	if (scalar_read(mdyn, key, val))
+		goto out_free;
+
+	printf("\n%s:\n", map->string);
+
+	if (mdyn->dump) {
+		mdyn->dump(stdout, map, key, 1);
+		goto out_free;
+	}
+
+	dump_node(stdout, rec, key);
+	fputs("\t", stdout);
+	dump_node(stdout, map, val);
+	fputs("\n", stdout);
+out_free:
+	free(key);
+}
+
+/* print the current value of all scalars. those that are mapped
+ * into our memory are read without any syscalls. */
+void map_report(node_t *script)
+{
+	mdyn_t *mdyn;
+	node_t *map;
+	char *key, *val;
+
+	for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next) {
+		map = mdyn->map;
+		if (!node_map_is_scalar(map))
+			continue;
+
+		key = calloc(1, map->map.rec->dyn.size + map->dyn.size);
+		assert(key);
+		val = key + map->map.rec->dyn.size;
+
+		if (!scalar_read(mdyn, key, val)) {
+			fprintf(stderr, "%s: ", map->string);
+			dump_node(stderr, map, val);
+			fputc('\n', stderr);
+		}
+
+		free(key);
+	}
+}
+
 void dump_mdyn(mdyn_t *mdyn)
 {
 	node_t *map = mdyn->map, *rec = map->map.rec;
@@ -231,6 +435,12 @@ void dump_mdyn(mdyn_t *mdyn)
 	char *key = data, *val = data + rec->dyn.size;
 	int err, n = 0;
 
+	if (node_map_is_scalar(map)) {
+		free(data);
+		dump_scalar(mdyn);
+		return;
+	}
+
 	__key_workaround(mdyn->mapfd, key, rec->dyn.size, val);
 
 	for (err = bpf_map_next(mdyn->mapfd, key, key); !err;
@@ -266,27 +476,353 @@ out_free:
 	free(data);
 }
 
+/* BPF_PSEUDO_MAP_VALUE loads were added in 5.2, try one on a map
+ * that we know to be an array. */
+static int map_direct_probe(int fd)
+{
+	static int supported = -1;
+	struct bpf_insn insns[] = {
+		INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_0, BPF_PSEUDO_MAP_VALUE, 0, fd),
+		INSN(0, 0, 0, 0, 0),
+		MOV_IMM(BPF_REG_0, 0),
+		EXIT,
+	};
+	int pfd;
+
+	if (supported >= 0)
+		return supported;
+
+	pfd = bpf_prog_load(BPF_PROG_TYPE_SOCKET_FILTER, insns,
+			    sizeof(insns) / sizeof(insns[0]));
+	supported = pfd >= 0;
+	if (supported)
+		close(pfd);
+	else
+		_d("no direct map value access, falling back to lookups");
+
+	return supported;
+}
+
+static size_t map_mem_size(mdyn_t *mdyn)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (mdyn->map->dyn.size + page - 1) & ~(page - 1);
+}
+
+/* arrays can be mapped into userspace from 5.5, so that their values
+ * can be read with plain loads. */
+static int map_scalar_create(mdyn_t *mdyn)
+{
+	void *mem;
+
+	mdyn->mapfd = __bpf_map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+				       mdyn->map->dyn.size, 1, BPF_F_MMAPABLE);
+	if (mdyn->mapfd < 0)
+		return bpf_map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+				      mdyn->map->dyn.size, 1);
+
+	mem = mmap(NULL, map_mem_size(mdyn), PROT_READ, MAP_SHARED,
+		   mdyn->mapfd, 0);
+	if (mem == MAP_FAILED) {
+		_d("%s: unable to map value, falling back to lookups",
+		   mdyn->map->string);
+		return mdyn->mapfd;
+	}
+
+	mdyn->mem = mem;
+	return mdyn->mapfd;
+}
+
+/* --set name=file, with or without the leading $ */
+static const char *map_set_file(const char *name)
+{
+	const char *set, *eq;
+	int i;
+
+	if (*name == '$')
+		name++;
+
+	for (i = 0; i < G.n_sets; i++) {
+		set = G.sets[i];
+		if (*set == '$')
+			set++;
+
+		eq = strchr(set, '=');
+		if (eq && (size_t)(eq - set) == strlen(name) &&
+		    !strncmp(set, name, eq - set))
+			return eq + 1;
+	}
+
+	return NULL;
+}
+
+/* large sets that are only tested for membership are stored in a
+ * bloom filter (5.16+), trading a few percent of false positives
+ * for a fraction of the memory of a hash. */
+#define SET_BLOOM_MIN (MAP_LEN << 7)
+
+#if HAVE_DECL_BPF_MAP_TYPE_BLOOM_FILTER && HAVE_DECL_BPF_FUNC_MAP_PEEK_ELEM
+# define SET_BLOOM 1
+#else
+# define SET_BLOOM 0
+#endif
+
+#if SET_BLOOM
+struct set_query {
+	const char *name;
+	int other;
+};
+
+static int _map_set_use(node_t *n, void *_q)
+{
+	struct set_query *q = _q;
+
+	if (n->type == TYPE_MAP && !strcmp(n->string, q->name) &&
+	    !(n->parent->type == TYPE_CALL && !strcmp(n->parent->string, "in")))
+		q->other++;
+
+	return 0;
+}
+
+/* true if the map is only ever used in `x in $set` tests */
+static int map_set_only(node_t *script, const char *name)
+{
+	struct set_query q = { .name = name };
+
+	node_walk(script, _map_set_use, NULL, &q);
+	return !q.other;
+}
+#endif
+
+/* one key per line, numbers or strings depending on the type of the
+ * key. */
+static int map_set_read(node_t *map, const char *path, char **keys)
+{
+	node_t *key = map->map.rec->rec.vargs;
+	size_t ksize = map->map.rec->dyn.size, len;
+	char line[0x200], *end;
+	int64_t num;
+	int n = 0, cap = 0;
+	FILE *fp;
+
+	if (map->map.rec->rec.n_vargs != 1) {
+		_e("%s: only sets with single component keys can be loaded",
+		   map->string);
+		return -EINVAL;
+	}
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		_pe("%s: unable to read '%s'", map->string, path);
+		return -errno;
+	}
+
+	*keys = NULL;
+	while (fgets(line, sizeof(line), fp)) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (!len)
+			continue;
+
+		if (n == cap) {
+			cap = cap ? cap << 1 : MAP_LEN;
+			*keys = realloc(*keys, cap * ksize);
+			assert(*keys);
+		}
+
+		memset(*keys + n * ksize, 0, ksize);
+
+		if (key->dyn.type == TYPE_INT) {
+			num = strtoll(line, &end, 0);
+			if (*end) {
+				_e("%s: '%s' is not a number", map->string, line);
+				goto err;
+			}
+
+			memcpy(*keys + n * ksize, &num, sizeof(num));
+		} else if (len < ksize) {
+			memcpy(*keys + n * ksize, line, len);
+		} else {
+			_e("%s: '%s' is longer than %zu characters",
+			   map->string, line, ksize - 1);
+			goto err;
+		}
+
+		n++;
+	}
+
+	fclose(fp);
+	return n;
+err:
+	fclose(fp);
+	free(*keys);
+	return -EINVAL;
+}
+
+static int map_set_setup(node_t *script, mdyn_t *mdyn, const char *path)
+{
+	node_t *map = mdyn->map;
+	size_t ksize = map->map.rec->dyn.size, vsize = map->dyn.size;
+	char *keys, *vals;
+	int err = 0, i, n;
+
+	n = map_set_read(map, path, &keys);
+	if (n < 0)
+		return n;
+
+	mdyn->set = 1;
+
+#if SET_BLOOM
+	if (n >= SET_BLOOM_MIN && map_set_only(script, map->string)) {
+		mdyn->mapfd = __bpf_map_create(BPF_MAP_TYPE_BLOOM_FILTER, 0,
+					       ksize, n, 0);
+		if (mdyn->mapfd >= 0) {
+			mdyn->bloom = 1;
+
+			for (i = 0; !err && i < n; i++)
+				err = bpf_map_update(mdyn->mapfd, NULL,
+						     keys + i * ksize, BPF_ANY);
+			goto out;
+		}
+
+		_d("%s: no bloom filter support, using a hash", map->string);
+	}
+#endif
+
+	mdyn->mapfd = bpf_map_create(BPF_MAP_TYPE_HASH, ksize, vsize,
+				     n > MAP_LEN ? n : MAP_LEN);
+	if (mdyn->mapfd < 0) {
+		err = mdyn->mapfd;
+		goto out;
+	}
+
+	vals = calloc(n ? n : 1, vsize);
+	assert(vals);
+
+	if (bpf_map_update_batch(mdyn->mapfd, keys, vals, n)) {
+		for (i = 0; !err && i < n; i++)
+			err = bpf_map_update(mdyn->mapfd, keys + i * ksize,
+					     vals + i * vsize, BPF_ANY);
+	}
+	free(vals);
+out:
+	if (err)
+		_pe("%s: unable to load set from '%s'", map->string, path);
+	else
+		_d("%s: %d keys loaded from '%s'%s", map->string, n, path,
+		   mdyn->bloom ? " into a bloom filter" : "");
+
+	free(keys);
+	return err;
+}
+
 int map_setup(node_t *script)
 {
 	mdyn_t *mdyn;
 	int dumpfd = 0xfd00;
+	const char *set;
 	size_t ksize, vsize;
+	int err, i;
+
+	for (i = 0; i < G.n_sets; i++) {
+		set = G.sets[i];
+		for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next) {
+			if (mdyn->map->type == TYPE_MAP &&
+			    map_set_file(mdyn->map->string) == strchr(set, '=') + 1)
+				break;
+		}
+
+		if (!mdyn) {
+			_e("set '%s' is not used by the script", set);
+			return -EINVAL;
+		}
+	}
 
 	for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next) {
 		if (G.dump) {
 			mdyn->mapfd = dumpfd++;
+			mdyn->direct = node_map_is_scalar(mdyn->map);
+			continue;
+		}
+
+		if (node_map_is_scalar(mdyn->map)) {
+			mdyn->mapfd = map_scalar_create(mdyn);
+			if (mdyn->mapfd <= 0) {
+				_pe("failed creating variable %s", mdyn->map->string);
+				return mdyn->mapfd;
+			}
+
+			mdyn->direct = map_direct_probe(mdyn->mapfd);
 			continue;
 		}
 
 		if (!strcmp(mdyn->map->string, "printf")) {
 			ksize = mdyn->map->dyn.size;
 			vsize = mdyn->map->call.vargs->next->dyn.size;
+		} else if (!strcmp(mdyn->map->string, "scratch")) {
+			mdyn->mapfd = bpf_map_create(BPF_MAP_TYPE_PERCPU_ARRAY,
+						     sizeof(uint32_t),
+						     mdyn->map->dyn.size, 1);
+			if (mdyn->mapfd <= 0) {
+				_pe("failed creating scratch map");
+				return mdyn->mapfd;
+			}
+			continue;
+		} else if (!strcmp(mdyn->map->string, "sample")) {
+			mdyn->mapfd = bpf_map_create(BPF_MAP_TYPE_PERCPU_ARRAY,
+						     sizeof(uint32_t),
+						     mdyn->map->dyn.size, 1);
+			if (mdyn->mapfd <= 0) {
+				_pe("failed creating sample map");
+				return mdyn->mapfd;
+			}
+			continue;
+		} else if (!strcmp(mdyn->map->string, "topk")) {
+			mdyn->mapfd = bpf_map_create(BPF_MAP_TYPE_PERCPU_ARRAY,
+						     sizeof(uint32_t),
+						     mdyn->map->dyn.size, 1);
+			if (mdyn->mapfd <= 0) {
+				_pe("failed creating topk sketch map");
+				return mdyn->mapfd;
+			}
+			continue;
+		} else if (!strcmp(mdyn->map->string, "latency")) {
+			mdyn->mapfd = bpf_map_create(BPF_MAP_TYPE_LRU_HASH,
+						     2 * sizeof(uint64_t),
+						     sizeof(uint64_t),
+						     LATENCY_MAP_LEN);
+			if (mdyn->mapfd <= 0) {
+				_pe("failed creating latency map");
+				return mdyn->mapfd;
+			}
+			continue;
+		} else if (!strcmp(mdyn->map->string, "stack")) {
+			mdyn->mapfd = bpf_map_create(BPF_MAP_TYPE_STACK_TRACE,
+						     sizeof(uint32_t),
+						     PERF_MAX_STACK_DEPTH * sizeof(uint64_t),
+						     STACK_MAP_LEN);
+			if (mdyn->mapfd <= 0) {
+				_pe("failed creating stack map");
+				return mdyn->mapfd;
+			}
+			continue;
 		} else {
+			set = map_set_file(mdyn->map->string);
+			if (set) {
+				err = map_set_setup(script, mdyn, set);
+				if (err)
+					return err;
+				continue;
+			}
+
 			ksize = mdyn->map->map.rec->dyn.size;
 			vsize = mdyn->map->dyn.size;
 		}
 
-		mdyn->mapfd = bpf_map_create(BPF_MAP_TYPE_HASH, ksize, vsize, MAP_LEN);
+		/* top-k candidates come and go, let the heavy ones stay */
+		mdyn->mapfd = bpf_map_create(mdyn->topk ? BPF_MAP_TYPE_LRU_HASH :
+					     BPF_MAP_TYPE_HASH, ksize, vsize, MAP_LEN);
 		if (mdyn->mapfd <= 0) {
 			_pe("failed creating map");
 			return mdyn->mapfd;
@@ -304,12 +840,23 @@ int map_teardown(node_t *script)
 		return 0;
 
 	for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next) {
-		if (mdyn->mapfd) {
-			if (strcmp(mdyn->map->string, "printf"))
-				dump_mdyn(mdyn);
+		if (mdyn->mapfd && !mdyn->set &&
+		    strcmp(mdyn->map->string, "printf") &&
+		    strcmp(mdyn->map->string, "scratch") &&
+		    strcmp(mdyn->map->string, "sample") &&
+		    strcmp(mdyn->map->string, "topk") &&
+		    strcmp(mdyn->map->string, "latency") &&
+		    strcmp(mdyn->map->string, "stack"))
+			dump_mdyn(mdyn);
+	}
 
+	/* stacks are resolved while dumping other maps, so wait
+	 * until all of them are done before closing anything. */
+	for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next) {
+		if (mdyn->mem)
+			munmap(mdyn->mem, map_mem_size(mdyn));
+		if (mdyn->mapfd)
 			close(mdyn->mapfd);
-		}
 	}
 
 	return 0;
@@ -21,9 +21,15 @@
 
 #include "lang/ast.h"
 
-void dump_sym(FILE *fp, node_t *integer, void *data);
+const char *ksym_get(uint64_t addr);
+
+void dump_sym  (FILE *fp, node_t *integer, void *data);
+void dump_stack(FILE *fp, node_t *stack, void *data);
 void dump_rec(FILE *fp, node_t *rec, void *data, int len);
 int  cmp_node(node_t *n, const void *a, const void *b);
 
-int map_setup   (node_t *script);
-int map_teardown(node_t *script);
+void *map_lookup_percpu(int fd, void *key, size_t size, int *n_cpus);
+
+int  map_setup   (node_t *script);
+int  map_teardown(node_t *script);
+void map_report  (node_t *script);
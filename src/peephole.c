@@ -0,0 +1,610 @@
+/*
+ * Copyright 2015-2016 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ply.h"
+#include "compile.h"
+
+/* The emitters favour simplicity over compactness, this pass cleans
+ * up after them. Each rule either rewrites an instruction in place
+ * or marks it for removal, after which the program is compacted and
+ * all jump offsets are adjusted. Rules are applied until nothing
+ * changes. */
+
+#define ALL_REGS ((1 << __MAX_BPF_REG) - 1)
+
+/* budget for the number of instructions visited when determining if
+ * a register is dead, branches are followed recursively. */
+#define DEAD_BUDGET 512
+
+typedef struct peep {
+	struct bpf_insn *insns;
+	size_t len;
+
+	int  *targets;
+	char *gone;
+} peep_t;
+
+static int insn_is_ldimm64(const struct bpf_insn *insn)
+{
+	return insn->code == (BPF_LD | BPF_DW | BPF_IMM);
+}
+
+static int insn_is_jmp(const struct bpf_insn *insn)
+{
+	if (BPF_CLASS(insn->code) != BPF_JMP)
+		return 0;
+
+	return BPF_OP(insn->code) != BPF_CALL && BPF_OP(insn->code) != BPF_EXIT;
+}
+
+static int insn_is_pcall(const struct bpf_insn *insn)
+{
+	return insn->code == (BPF_JMP | BPF_CALL) &&
+		insn->src_reg == BPF_PSEUDO_CALL;
+}
+
+static int insn_is_cond(const struct bpf_insn *insn)
+{
+	return insn_is_jmp(insn) && BPF_OP(insn->code) != BPF_JA;
+}
+
+/* registers read by an instruction */
+static int insn_uses(const struct bpf_insn *insn)
+{
+	int src = 1 << insn->src_reg, dst = 1 << insn->dst_reg;
+
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_ALU:
+	case BPF_ALU64:
+		if (BPF_OP(insn->code) == BPF_MOV)
+			return (BPF_SRC(insn->code) == BPF_X) ? src : 0;
+		if (BPF_OP(insn->code) == BPF_NEG)
+			return dst;
+
+		return dst | ((BPF_SRC(insn->code) == BPF_X) ? src : 0);
+
+	case BPF_LD:
+		return 0;
+	case BPF_LDX:
+		return src;
+	case BPF_ST:
+		return dst;
+	case BPF_STX:
+		return dst | src;
+
+	case BPF_JMP:
+		switch (BPF_OP(insn->code)) {
+		case BPF_JA:
+			return 0;
+		case BPF_CALL:
+			return (1 << BPF_REG_1) | (1 << BPF_REG_2) |
+				(1 << BPF_REG_3) | (1 << BPF_REG_4) |
+				(1 << BPF_REG_5);
+		case BPF_EXIT:
+			return 1 << BPF_REG_0;
+		default:
+			return dst | ((BPF_SRC(insn->code) == BPF_X) ? src : 0);
+		}
+	}
+
+	return ALL_REGS;
+}
+
+/* registers written by an instruction */
+static int insn_defs(const struct bpf_insn *insn)
+{
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_ALU:
+	case BPF_ALU64:
+	case BPF_LDX:
+		return 1 << insn->dst_reg;
+
+	case BPF_LD:
+		return insn_is_ldimm64(insn) ? (1 << insn->dst_reg) : 0;
+
+	case BPF_JMP:
+		if (BPF_OP(insn->code) == BPF_CALL)
+			return CALLER_REGS;
+		return 0;
+	}
+
+	return 0;
+}
+
+static size_t jmp_target(peep_t *pp, size_t ip)
+{
+	return ip + 1 + pp->insns[ip].off;
+}
+
+static size_t pcall_target(peep_t *pp, size_t ip)
+{
+	return ip + 1 + pp->insns[ip].imm;
+}
+
+static void peep_scan(peep_t *pp)
+{
+	size_t ip, to;
+
+	memset(pp->targets, 0, (pp->len + 1) * sizeof(*pp->targets));
+	memset(pp->gone, 0, pp->len);
+
+	for (ip = 0; ip < pp->len; ip++) {
+		if (insn_is_ldimm64(&pp->insns[ip])) {
+			ip++;
+			continue;
+		}
+
+		/* subprogram entries are targets too, nothing may be
+		 * moved across them. */
+		if (insn_is_pcall(&pp->insns[ip]))
+			to = pcall_target(pp, ip);
+		else if (insn_is_jmp(&pp->insns[ip]))
+			to = jmp_target(pp, ip);
+		else
+			continue;
+
+		if (to <= pp->len)
+			pp->targets[to]++;
+	}
+}
+
+static int __reg_dead(peep_t *pp, size_t ip, int reg, int *budget)
+{
+	const struct bpf_insn *insn;
+
+	for (; ip < pp->len; ip++) {
+		if (--(*budget) < 0)
+			return 0;
+
+		insn = &pp->insns[ip];
+		if (pp->gone[ip])
+			continue;
+
+		if (insn_uses(insn) & (1 << reg))
+			return 0;
+		if (insn_defs(insn) & (1 << reg))
+			return 1;
+
+		if (insn_is_ldimm64(insn)) {
+			ip++;
+			continue;
+		}
+
+		if (BPF_CLASS(insn->code) != BPF_JMP)
+			continue;
+
+		switch (BPF_OP(insn->code)) {
+		case BPF_EXIT:
+			return 1;
+		case BPF_CALL:
+			continue;
+		case BPF_JA:
+			ip = jmp_target(pp, ip) - 1;
+			continue;
+		default:
+			if (!__reg_dead(pp, jmp_target(pp, ip), reg, budget))
+				return 0;
+			continue;
+		}
+	}
+
+	return 0;
+}
+
+/* is the value of reg unused from ip and onwards, on all paths? */
+static int reg_dead(peep_t *pp, size_t ip, int reg)
+{
+	int budget = DEAD_BUDGET;
+
+	if (reg == BPF_REG_10)
+		return 0;
+
+	return __reg_dead(pp, ip, reg, &budget);
+}
+
+/* invert the condition of insn in place. JLT/JLE and friends are
+ * only available from 4.14, so a > b is inverted to b >= a, which
+ * is only possible when both operands are registers. */
+static int jmp_invert(struct bpf_insn *insn)
+{
+	int op, reg;
+
+	switch (BPF_OP(insn->code)) {
+	case BPF_JEQ:  op = BPF_JNE;  break;
+	case BPF_JNE:  op = BPF_JEQ;  break;
+#ifdef BPF_JLT
+	/* already limited to 4.14+ */
+	case BPF_JLT:  op = BPF_JGE;  break;
+	case BPF_JLE:  op = BPF_JGT;  break;
+#endif
+#ifdef BPF_JSLT
+	case BPF_JSLT: op = BPF_JSGE; break;
+	case BPF_JSLE: op = BPF_JSGT; break;
+#endif
+	case BPF_JGT:  op = BPF_JGE;  goto swap;
+	case BPF_JGE:  op = BPF_JGT;  goto swap;
+	case BPF_JSGT: op = BPF_JSGE; goto swap;
+	case BPF_JSGE: op = BPF_JSGT; goto swap;
+	default:
+		return -1;
+	}
+
+	insn->code = BPF_JMP | op | BPF_SRC(insn->code);
+	return 0;
+
+swap:
+	if (BPF_SRC(insn->code) != BPF_X)
+		return -1;
+
+	reg = insn->dst_reg;
+	insn->dst_reg = insn->src_reg;
+	insn->src_reg = reg;
+	insn->code = BPF_JMP | op | BPF_X;
+	return 0;
+}
+
+/* mov rX, rX, arithmetic with no effect and jumps to the next
+ * instruction */
+static int peep_nop(peep_t *pp, size_t ip)
+{
+	struct bpf_insn *insn = &pp->insns[ip];
+
+	if (insn->code == (BPF_ALU64 | BPF_MOV | BPF_X) &&
+	    insn->dst_reg == insn->src_reg)
+		goto nop;
+
+	if (BPF_CLASS(insn->code) == BPF_ALU64 && BPF_SRC(insn->code) == BPF_K &&
+	    !insn->imm) {
+		switch (BPF_OP(insn->code)) {
+		case BPF_ADD:
+		case BPF_SUB:
+		case BPF_OR:
+		case BPF_XOR:
+		case BPF_LSH:
+		case BPF_RSH:
+			goto nop;
+		}
+	}
+
+	if (insn_is_jmp(insn) && !insn->off)
+		goto nop;
+
+	return 0;
+nop:
+	pp->gone[ip] = 1;
+	return 1;
+}
+
+/* writes to registers that are never read */
+static int peep_dead_def(peep_t *pp, size_t ip)
+{
+	struct bpf_insn *insn = &pp->insns[ip];
+
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_ALU:
+	case BPF_ALU64:
+	case BPF_LDX:
+		break;
+	default:
+		return 0;
+	}
+
+	if (!reg_dead(pp, ip + 1, insn->dst_reg))
+		return 0;
+
+	pp->gone[ip] = 1;
+	return 1;
+}
+
+/* stxdw [r10 + off], rX where rX is a known constant, is replaced by
+ * a store of an immediate. typically used to zero out the stack,
+ * after which the mov of the constant is often dead. */
+static int peep_store_imm(peep_t *pp, size_t ip)
+{
+	struct bpf_insn *insn = &pp->insns[ip], *def;
+	ssize_t i;
+
+	if (BPF_CLASS(insn->code) != BPF_STX || BPF_MODE(insn->code) != BPF_MEM)
+		return 0;
+
+	for (i = ip - 1; i >= 0; i--) {
+		def = &pp->insns[i];
+
+		if (pp->targets[i + 1] || insn_is_jmp(def))
+			return 0;
+
+		if (!(insn_defs(def) & (1 << insn->src_reg)))
+			continue;
+
+		if (def->code != (BPF_ALU64 | BPF_MOV | BPF_K))
+			return 0;
+
+		*insn = INSN(BPF_ST | BPF_SIZE(insn->code) | BPF_MEM,
+			     insn->dst_reg, 0, insn->off, def->imm);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* stxdw [r10 + off], rX followed by lddw rY, [r10 + off] is turned
+ * into a register move. */
+static int peep_store_load(peep_t *pp, size_t ip)
+{
+	struct bpf_insn *st = &pp->insns[ip], *insn;
+	size_t i;
+
+	if (st->code != (BPF_STX | BPF_DW | BPF_MEM) || st->dst_reg != BPF_REG_10)
+		return 0;
+
+	for (i = ip + 1; i < pp->len; i++) {
+		insn = &pp->insns[i];
+
+		if (pp->targets[i] || BPF_CLASS(insn->code) == BPF_JMP)
+			return 0;
+
+		if (insn->code == (BPF_LDX | BPF_DW | BPF_MEM) &&
+		    insn->src_reg == BPF_REG_10 && insn->off == st->off) {
+			*insn = MOV(insn->dst_reg, st->src_reg);
+			return 1;
+		}
+
+		if (insn_defs(insn) & (1 << st->src_reg))
+			return 0;
+
+		/* any overlapping store invalidates the slot */
+		if ((BPF_CLASS(insn->code) == BPF_ST ||
+		     BPF_CLASS(insn->code) == BPF_STX) &&
+		    (insn->dst_reg != BPF_REG_10 ||
+		     (insn->off < st->off + 8 && st->off < insn->off + 8)))
+			return 0;
+
+		if (insn_is_ldimm64(insn))
+			i++;
+	}
+
+	return 0;
+}
+
+/* mov rB, rA followed by an instruction reading rB, with rB dead
+ * afterwards, reads rA directly instead. */
+static int peep_copy(peep_t *pp, size_t ip)
+{
+	struct bpf_insn *mov = &pp->insns[ip], *insn;
+	int a = mov->src_reg, b = mov->dst_reg;
+
+	if (mov->code != (BPF_ALU64 | BPF_MOV | BPF_X) || ip + 1 >= pp->len)
+		return 0;
+
+	insn = &pp->insns[ip + 1];
+	if (pp->targets[ip + 1])
+		return 0;
+
+	/* only the simple cases, a conditional jump or a store */
+	if (insn_is_cond(insn)) {
+		if (insn->dst_reg != b ||
+		    (BPF_SRC(insn->code) == BPF_X && insn->src_reg == b))
+			return 0;
+
+		if (!reg_dead(pp, ip + 2, b) ||
+		    !reg_dead(pp, jmp_target(pp, ip + 1), b))
+			return 0;
+
+		insn->dst_reg = a;
+	} else if (BPF_CLASS(insn->code) == BPF_STX) {
+		if (insn->src_reg != b || insn->dst_reg == b)
+			return 0;
+
+		if (!reg_dead(pp, ip + 2, b))
+			return 0;
+
+		insn->src_reg = a;
+	} else {
+		return 0;
+	}
+
+	pp->gone[ip] = 1;
+	return 1;
+}
+
+/* jCC +1; ja +N  =>  j!CC +N+1 */
+static int peep_jmp_invert(peep_t *pp, size_t ip)
+{
+	struct bpf_insn *insn = &pp->insns[ip], *ja;
+
+	if (!insn_is_cond(insn) || insn->off != 1 || ip + 1 >= pp->len)
+		return 0;
+
+	ja = &pp->insns[ip + 1];
+	if (ja->code != (BPF_JMP | BPF_JA) || pp->targets[ip + 1])
+		return 0;
+
+	if (jmp_invert(insn))
+		return 0;
+
+	insn->off  = ja->off + 1;
+	pp->gone[ip + 1] = 1;
+	return 1;
+}
+
+/* a boolean materialised from a comparison, and then tested:
+ *
+ *     jCC  ..., +2
+ *     mov  rA, #0       (or #1)
+ *     ja   +1
+ *     mov  rA, #1       (or #0)
+ *     jne  rA, #0, +N   (or jeq)
+ *
+ * is fused into a single conditional branch.
+ */
+static int peep_bool_fuse(peep_t *pp, size_t ip)
+{
+	struct bpf_insn *insn = pp->insns + ip, *test;
+	size_t i, to;
+	int a, when;
+
+	if (!insn_is_cond(insn) || insn->off != 2 || ip + 4 >= pp->len)
+		return 0;
+
+	a = insn[1].dst_reg;
+	if (insn[1].code != (BPF_ALU64 | BPF_MOV | BPF_K) ||
+	    insn[2].code != (BPF_JMP | BPF_JA) || insn[2].off != 1 ||
+	    insn[3].code != (BPF_ALU64 | BPF_MOV | BPF_K) ||
+	    insn[3].dst_reg != a ||
+	    !!insn[1].imm == !!insn[3].imm)
+		return 0;
+
+	test = &insn[4];
+	if ((test->code != (BPF_JMP | BPF_JNE | BPF_K) &&
+	     test->code != (BPF_JMP | BPF_JEQ | BPF_K)) ||
+	    test->dst_reg != a || test->imm != 0)
+		return 0;
+
+	/* the last two are targeted from within the sequence, but
+	 * nothing else may jump into it. */
+	if (pp->targets[ip + 1] || pp->targets[ip + 2] ||
+	    pp->targets[ip + 3] != 1 || pp->targets[ip + 4] != 1)
+		return 0;
+
+	to = jmp_target(pp, ip + 4);
+	if (!reg_dead(pp, ip + 5, a) || !reg_dead(pp, to, a))
+		return 0;
+
+	/* is the branch taken when the comparison is true? */
+	when = !!insn[3].imm;
+	if (BPF_OP(test->code) == BPF_JEQ)
+		when = !when;
+
+	if (!when && jmp_invert(insn))
+		return 0;
+
+	insn->off = to - ip - 1;
+	for (i = ip + 1; i <= ip + 4; i++)
+		pp->gone[i] = 1;
+
+	return 1;
+}
+
+static void peep_compact(peep_t *pp)
+{
+	size_t *map, ip, out;
+
+	map = calloc(pp->len + 1, sizeof(*map));
+	assert(map);
+
+	for (ip = 0, out = 0; ip < pp->len; ip++) {
+		map[ip] = out;
+		if (!pp->gone[ip])
+			out++;
+	}
+	map[pp->len] = out;
+
+	for (ip = 0; ip < pp->len; ip++) {
+		if (pp->gone[ip])
+			continue;
+
+		if (insn_is_ldimm64(&pp->insns[ip])) {
+			ip++;
+			continue;
+		}
+
+		if (insn_is_pcall(&pp->insns[ip]))
+			pp->insns[ip].imm = map[pcall_target(pp, ip)] - map[ip] - 1;
+		else if (insn_is_jmp(&pp->insns[ip]))
+			pp->insns[ip].off = map[jmp_target(pp, ip)] - map[ip] - 1;
+	}
+
+	for (ip = 0, out = 0; ip < pp->len; ip++) {
+		if (!pp->gone[ip])
+			pp->insns[out++] = pp->insns[ip];
+	}
+
+	pp->len = out;
+	free(map);
+}
+
+static int (*peep_rules[])(peep_t *pp, size_t ip) = {
+	peep_nop,
+	peep_jmp_invert,
+	peep_bool_fuse,
+	peep_copy,
+	peep_store_load,
+	peep_store_imm,
+	peep_dead_def,
+
+	NULL
+};
+
+int peephole(prog_t *prog)
+{
+	peep_t pp;
+	size_t ip, orig;
+	int (**rule)(peep_t *pp, size_t ip);
+	int changed;
+
+	pp.insns = prog->insns;
+	pp.len   = prog->ip - prog->insns;
+	orig     = pp.len;
+
+	pp.targets = calloc(pp.len + 1, sizeof(*pp.targets));
+	pp.gone    = malloc(pp.len);
+	assert(pp.targets && pp.gone);
+
+	do {
+		changed = 0;
+
+		for (rule = peep_rules; *rule; rule++) {
+			peep_scan(&pp);
+
+			for (ip = 0; ip < pp.len; ip++) {
+				if (insn_is_ldimm64(&pp.insns[ip])) {
+					ip++;
+					continue;
+				}
+
+				/* rules may look at their neighbours, so
+				 * leave anything that is already gone. */
+				if (pp.gone[ip])
+					continue;
+
+				changed |= (*rule)(&pp, ip);
+			}
+
+			peep_compact(&pp);
+		}
+	} while (changed);
+
+	free(pp.gone);
+	free(pp.targets);
+
+	prog->ip = prog->insns + pp.len;
+
+	_d("%zu -> %zu instructions", orig, pp.len);
+	if (G.debug && pp.len != orig) {
+		for (ip = 0; ip < pp.len; ip++)
+			dump_insn(pp.insns[ip], ip);
+	}
+
+	return 0;
+}
@@ -18,12 +18,16 @@
  */
 
 #include <getopt.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 
 #include "ply.h"
+#include "filter.h"
+#include "governor.h"
 #include "map.h"
+#include "stats.h"
 #include "lang/ast.h"
 #include "pvdr/pvdr.h"
 
@@ -31,13 +35,24 @@ FILE *scriptfp;
 
 struct globals G;
 
-static const char *sopts = "AcdDht:";
+#define OPT_CGROUP 0x100
+#define OPT_COMM   0x101
+
+static const char *sopts = "AcdDfhi:o:p:sS:t:";
 static struct option lopts[] = {
 	{ "ascii",   no_argument,       0, 'A' },
+	{ "cgroup",  required_argument, 0, OPT_CGROUP },
 	{ "command", no_argument,       0, 'c' },
+	{ "comm",    required_argument, 0, OPT_COMM },
 	{ "debug",   no_argument,       0, 'd' },
 	{ "dump",    no_argument,       0, 'D' },
+	{ "folded",  no_argument,       0, 'f' },
 	{ "help",    no_argument,       0, 'h' },
+	{ "interval", required_argument, 0, 'i' },
+	{ "max-overhead", required_argument, 0, 'o' },
+	{ "pid",     required_argument, 0, 'p' },
+	{ "set",     required_argument, 0, 'S' },
+	{ "stats",   no_argument,       0, 's' },
 	{ "timeout", required_argument, 0, 't' },
 
 	{ NULL }
@@ -50,8 +65,36 @@ void usage()
 	printf("       -c 'program'	# execute specified program\n");
 	printf("       -d		# include compilation debug info\n");
 	printf("       -D		# dump BPF, and do not run\n");
+	printf("       -f		# print stacks folded, for flame graphs\n");
 	printf("       -h		# usage message (this)\n");
+	printf("       -i interval	# print statistics and variables periodically (seconds)\n");
+	printf("       -o pct	# limit CPU time spent in probes, sample or detach\n");
+	printf("       -p pid[,pid]	# only trace the given processes\n");
+	printf("       -s		# print load and run-time statistics\n");
+	printf("       -S set=file	# load the keys of $set from file, one per line\n");
 	printf("       -t timeout	# run duration (seconds)\n");
+	printf("       --cgroup path	# only trace tasks in the given cgroup (v2)\n");
+	printf("       --comm name	# only trace tasks with the given name\n");
+}
+
+static int parse_pids(char *list)
+{
+	char *pid, *end;
+
+	for (pid = strtok(list, ","); pid; pid = strtok(NULL, ",")) {
+		G.pids = realloc(G.pids, (G.n_pids + 1) * sizeof(*G.pids));
+		assert(G.pids);
+
+		G.pids[G.n_pids] = strtol(pid, &end, 0);
+		if (*end || G.pids[G.n_pids] <= 0) {
+			_e("invalid pid '%s'", pid);
+			return -EINVAL;
+		}
+
+		G.n_pids++;
+	}
+
+	return 0;
 }
 
 int parse_opts(int argc, char **argv, FILE **sfp)
@@ -73,9 +116,44 @@ int parse_opts(int argc, char **argv, FILE **sfp)
 		case 'D':
 			G.dump++;
 			break;
+		case 'f':
+			G.folded++;
+			break;
 		case 'h':
 			usage();
 			exit(0);
+		case 'i':
+			G.interval = strtol(optarg, NULL, 0);
+			if (G.interval <= 0) {
+				_e("interval must be a positive integer");
+				return -EINVAL;
+			}
+			G.stats = 1;
+			break;
+		case 'o':
+			G.max_overhead = strtod(optarg, NULL);
+			if (G.max_overhead <= 0) {
+				_e("overhead must be a positive percentage");
+				return -EINVAL;
+			}
+			break;
+		case 'p':
+			if (parse_pids(optarg))
+				return -EINVAL;
+			break;
+		case 's':
+			G.stats++;
+			break;
+		case 'S':
+			if (!strchr(optarg, '=')) {
+				_e("expected set=file, got '%s'", optarg);
+				return -EINVAL;
+			}
+
+			G.sets = realloc(G.sets, (G.n_sets + 1) * sizeof(*G.sets));
+			assert(G.sets);
+			G.sets[G.n_sets++] = optarg;
+			break;
 		case 't':
 			G.timeout = strtol(optarg, NULL, 0);
 			if (G.timeout <= 0) {
@@ -83,6 +161,16 @@ int parse_opts(int argc, char **argv, FILE **sfp)
 				return -EINVAL;
 			}
 			break;
+		case OPT_CGROUP:
+			G.cgroup = optarg;
+			break;
+		case OPT_COMM:
+			if (strlen(optarg) > 15) {
+				_e("comm '%s' is longer than 15 characters", optarg);
+				return -EINVAL;
+			}
+			G.comm = optarg;
+			break;
 		default:
 			_e("unknown option '%c'. Try -h for usage.", opt);
 			return -EINVAL;
@@ -110,13 +198,63 @@ void sigint(int sigint)
 	return;
 }
 
+/* tear down every probe that was set up, i.e. those before `until`,
+ * or all of them. */
+static int ply_teardown(node_t *script, node_t *until)
+{
+	node_t *probe;
+	FILE *kevents;
+	int err = 0;
+
+	node_foreach(probe, script->script.probes) {
+		if (probe == until)
+			break;
+
+		err = node_get_pvdr(probe)->teardown(probe);
+		if (err)
+			break;
+	}
+
+	kevents = fopen("/sys/kernel/debug/tracing/kprobe_events", "w");
+	if (kevents)
+		fclose(kevents);
+
+	return err;
+}
+
+/* wait for a signal to end the session. meanwhile, keep the printf
+ * buffer drained and report run-time statistics and variables. */
+static void ply_wait(node_t *script)
+{
+	int flush = printf_active(script), ticks = 0;
+
+	if (!flush && !G.interval && !G.max_overhead) {
+		poll(NULL, 0, -1);
+		return;
+	}
+
+	do {
+		if (flush)
+			printf_flush(script);
+
+		ticks++;
+		if (G.max_overhead && !(ticks % 5))
+			governor_tick(script);
+
+		if (G.interval && !(ticks % (G.interval * 5))) {
+			stats_report(script);
+			map_report(script);
+		}
+	} while (!usleep(200000));
+}
+
 int main(int argc, char **argv)
 {
 	FILE *sfp, *enable;
 	node_t *probe, *script = NULL;
 	prog_t *prog = NULL;
 	pvdr_t *pvdr;
-	int err = 0, num;
+	int err = 0, num = 0;
 
 	scriptfp = stdin;
 	err = parse_opts(argc, argv, &sfp);
@@ -140,33 +278,49 @@ int main(int argc, char **argv)
 	err = map_setup(script);
 	if (err)
 		goto err;
+
+	err = governor_setup(script);
+	if (err)
+		goto err;
+
+	err = filter_setup(script);
+	if (err)
+		goto err;
 		
 	if (G.dump)
 		node_ast_dump(script);
 
+	/* before anything is attached, a failure here has nothing to
+	 * tear down. */
+	if (!G.dump && (G.stats || G.max_overhead)) {
+		err = stats_enable();
+		if (err && G.max_overhead)
+			goto err;
+	}
+
 	node_foreach(probe, script->script.probes) {
 		err = -EINVAL;
 		prog = compile_probe(probe);
 		if (!prog)
-			break;
+			goto err_setup;
 
+		probe->dyn.probe.prog = prog;
 		if (G.dump)
 			continue;
 
 		pvdr = node_get_pvdr(probe);
-		num = pvdr->setup(probe, prog);
-		if (num < 0)
-			break;
+		err = pvdr->setup(probe, prog);
+		if (err < 0)
+			goto err_setup;
+
+		probe->dyn.probe.n_events = err;
+		num += err;
 	}
 
+	err = 0;
 	_d("compilation ok");
 	if (G.dump)
 		goto done;
-	
-	if (num < 0) {
-		err = num;
-		goto err;
-	}
 
 	if (G.timeout) {
 		siginterrupt(SIGALRM, 1);
@@ -176,42 +330,69 @@ int main(int argc, char **argv)
 
 	siginterrupt(SIGINT, 1);
 	signal(SIGINT, sigint);
-	
+
+	/* the kprobes group only exists if at least one kprobe has
+	 * been created, scripts containing only perf event based
+	 * probes will not have it. */
 	enable = fopen("/sys/kernel/debug/tracing/events/kprobes/enable", "w");
-	if (!enable) {
+	if (!enable && errno != ENOENT) {
 		perror("unable to enable probes");
 		err = -errno;
 		goto err;
 	}
 
-	fputs("1\n", enable);
-	fflush(enable);
-	rewind(enable);
+	if (enable) {
+		fputs("1\n", enable);
+		fflush(enable);
+		rewind(enable);
+	}
 
-	fprintf(stderr, "%d probe%s active\n", num, (num == 1) ? "" : "s");
-	printf_drain(script);
+	node_foreach(probe, script->script.probes) {
+		pvdr = node_get_pvdr(probe);
+		if (pvdr->start)
+			pvdr->start(probe);
+	}
 
-	fprintf(stderr, "de-activating probes\n");
-	fputs("0\n", enable);
-	fflush(enable);
-	fclose(enable);
+	fprintf(stderr, "%d probe%s active\n", num, (num == 1) ? "" : "s");
+	ply_wait(script);
 
 	node_foreach(probe, script->script.probes) {
 		pvdr = node_get_pvdr(probe);
-		err = pvdr->teardown(probe);
-		if (err)
-			break;
+		if (pvdr->stop)
+			pvdr->stop(probe);
 	}
 
-	fclose(fopen("/sys/kernel/debug/tracing/kprobe_events", "w"));
+	if (G.stats) {
+		stats_report(script);
+		stats_disable();
+	}
+
+	printf_flush(script);
+
+	fprintf(stderr, "de-activating probes\n");
+	if (enable) {
+		fputs("0\n", enable);
+		fflush(enable);
+		fclose(enable);
+	}
 
+	err = ply_teardown(script, NULL);
 	map_teardown(script);
+	goto done;
+
+err_setup:
+	/* the probes before the one that failed are live */
+	if (!G.dump)
+		ply_teardown(script, probe);
 done:
 err:
-	if (prog)
-		free(prog);
-	if (script)
+	stats_disable();
+	if (script) {
+		node_foreach(probe, script->script.probes)
+			prog_free(probe->dyn.probe.prog);
+
 		node_free(script);
+	}
 
 	return err;
 }
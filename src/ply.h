@@ -26,6 +26,14 @@
 
 #define MAP_LEN 512
 
+/* stack ids are hashed into buckets, keep plenty of them to avoid
+ * collisions between distinct stacks. */
+#define STACK_MAP_LEN (MAP_LEN << 3)
+
+/* in-flight entry times for latency(), threads that never return
+ * are eventually evicted. */
+#define LATENCY_MAP_LEN (MAP_LEN << 3)
+
 #define PRINTF_BUF_LEN MAP_LEN
 #define PRINTF_META_OF (1 << 30)
 
@@ -38,7 +46,17 @@ struct globals {
   int ascii:1;
   int debug:1;
   int dump:1;
+  int folded:1;
+  int stats:1;
+  int interval;
+  double max_overhead;
   int timeout;
+  int *pids;
+  int n_pids;
+  const char *cgroup;
+  const char *comm;
+  char **sets;
+  int n_sets;
 };
 extern struct globals G;
 
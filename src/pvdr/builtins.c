@@ -17,12 +17,17 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "../ply.h"
+#include "../bpf-syscall.h"
 #include "../map.h"
 #include "arch.h"
 #include "pvdr.h"
@@ -30,6 +35,10 @@
 typedef struct builtin {
 	const char *name;
 
+	/* set if the builtin never calls any helpers, i.e. it only
+	 * uses the scratch registers. */
+	int leaf;
+
 	int (*annotate)  (node_t *call);
 	int (*loc_assign)(node_t *call);
 	int  (*compile)  (node_t *call, prog_t *prog);
@@ -122,7 +131,7 @@ static int comm_compile(node_t *call, prog_t *prog)
 {
 	emit_stack_zero(prog, call);
 
-	emit(prog, MOV(BPF_REG_1, BPF_REG_10));
+	emit(prog, MOV(BPF_REG_1, mem_base(call->dyn.addr)));
 	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_1, call->dyn.addr));
 	emit(prog, MOV_IMM(BPF_REG_2, call->dyn.size));
 	emit(prog, CALL(BPF_FUNC_get_current_comm));
@@ -139,29 +148,105 @@ static int comm_annotate(node_t *call)
 	return 0;
 }
 
+/* load n bytes of s, starting at off, into reg. the remaining bytes
+ * of the register are cleared, they are the high-order ones on little
+ * endian hosts and the low-order ones on big endian hosts. literals
+ * are copied into a host order word, which lines them up the same
+ * way. */
+static void strcmp_load(prog_t *prog, node_t *s, int reg, ssize_t off, size_t n)
+{
+	uint64_t word = 0;
+	int shift = (sizeof(word) - n) << 3;
+
+	if (s->type == TYPE_STR) {
+		memcpy(&word, s->string + off, n);
+
+		if (word <= INT32_MAX)
+			emit(prog, MOV_IMM(reg, word));
+		else
+			emit_ld_imm64(prog, reg, word);
+		return;
+	}
+
+	emit(prog, LDXDW(reg, s->dyn.addr + off, mem_base(s->dyn.addr)));
+	if (!shift)
+		return;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	emit(prog, ALU_IMM(ALU_OP_RSH, reg, shift));
+	emit(prog, ALU_IMM(ALU_OP_LSH, reg, shift));
+#else
+	emit(prog, ALU_IMM(ALU_OP_LSH, reg, shift));
+	emit(prog, ALU_IMM(ALU_OP_RSH, reg, shift));
+#endif
+}
+
 static int strcmp_compile(node_t *call, prog_t *prog)
 {
 	node_t *s1 = call->call.vargs, *s2 = call->call.vargs->next;
-	ssize_t i, l1, l2, l;
-	int dst = call->dyn.loc == LOC_REG ? call->dyn.reg : BPF_REG_0;
+	size_t jmps[BPF_MAXINSNS / 8], mismatch;
+	ssize_t l1, l2, l, off;
+	int i, n_jmps = 0, res;
 	
 	l1 = s1->type == TYPE_STR ? strlen(s1->string) + 1 : s1->dyn.size;
 	l2 = s2->type == TYPE_STR ? strlen(s2->string) + 1 : s2->dyn.size;
 	l  = l1 < l2 ? l1 : l2; 
 
-	for (i = 0; l; i++, l--) {
-		emit(prog, LDXB(      dst, s1->dyn.addr + i, BPF_REG_10));
-		emit(prog, LDXB(BPF_REG_1, s2->dyn.addr + i, BPF_REG_10));
-		emit(prog, ALU(ALU_OP_SUB, dst, BPF_REG_1));
+	if (s1->type == TYPE_STR && s2->type == TYPE_STR) {
+		res = strncmp(s1->string, s2->string, l);
+		emit(prog, MOV_IMM(BPF_REG_0, res < 0 ? -1 : !!res));
+		return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+	}
 
-		if (l == 1)
-			break;
+	/* compare a word at a time, the string data is zero padded
+	 * up to an aligned size, so words never reach outside of it,
+	 * and the tail is masked off. */
+	for (off = 0; off < l; off += sizeof(uint64_t)) {
+		size_t n = (l - off) < 8 ? (l - off) : 8;
 
-		emit(prog, JMP_IMM(JMP_JEQ, BPF_REG_1, 0, 5 * (l - 2) + 4));
-		emit(prog, JMP_IMM(JMP_JNE,       dst, 0, 5 * (l - 2) + 3));
+		strcmp_load(prog, s1, BPF_REG_0, off, n);
+		strcmp_load(prog, s2, BPF_REG_1, off, n);
+
+		/* the buffer may move as it grows, keep offsets */
+		jmps[n_jmps++] = prog->ip - prog->insns;
+		emit(prog, JMP(JMP_JNE, BPF_REG_0, BPF_REG_1, 0));
 	}
 
-	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[dst]);
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, JMP_IMM(JMP_JA, 0, 0, 6));
+
+	/* the first differing word decides the order. make the first
+	 * character the most significant one, which is a no-op on big
+	 * endian hosts. */
+	mismatch = prog->ip - prog->insns;
+	for (i = 0; !prog->err && i < n_jmps; i++)
+		prog->insns[jmps[i]].off = mismatch - jmps[i] - 1;
+
+	emit(prog, BE64(BPF_REG_0));
+	emit(prog, BE64(BPF_REG_1));
+	emit(prog, JMP(JMP_JGT, BPF_REG_0, BPF_REG_1, 2));
+	emit(prog, MOV_IMM(BPF_REG_0, -1));
+	emit(prog, JMP_IMM(JMP_JA, 0, 0, 1));
+	emit(prog, MOV_IMM(BPF_REG_0, 1));
+
+	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+}
+
+static int strcmp_loc_assign(node_t *call)
+{
+	node_t *probe = node_get_probe(call);
+	node_t *varg;
+
+	/* literals are compared against immediates, there is no need
+	 * to store them. */
+	node_foreach(varg, call->call.vargs) {
+		if (varg->type == TYPE_STR)
+			varg->dyn.loc = LOC_VIRTUAL;
+		else
+			node_probe_mem_get(probe, varg, varg->dyn.size);
+	}
+
+	return 0;
 }
 
 static int strcmp_annotate(node_t *call)
@@ -184,42 +269,337 @@ static int strcmp_annotate(node_t *call)
 	return 0;
 }
 
-static int reg_compile(node_t *call, prog_t *prog)
+/* glob patterns, `*`, `?`, `[a-z...]`, `[!a-z...]` and `\` escapes, are matched
+ * with a bit-parallel NFA. bit j+1 of the state is set when the
+ * first j tokens of the pattern have matched. for each byte of the
+ * string, the state advances over every token that accepts the byte,
+ * stars also keep their state. the loop is unrolled over the string
+ * buffer, so the cost is bounded by its size. */
+#define GLOB_TOKENS_MAX 30
+#define GLOB_RANGES_MAX 64
+
+typedef struct glob {
+	int n_tokens;
+
+	uint32_t any;
+	uint32_t star;
+	uint32_t chars[256];
+	uint32_t not_chars[256];
+
+	int n_ranges;
+	struct {
+		uint8_t lo, hi;
+		uint32_t bit;
+		int neg;
+	} ranges[GLOB_RANGES_MAX];
+} glob_t;
+
+/* negated classes accept any byte, their members then clear it */
+static int glob_range(glob_t *g, uint8_t lo, uint8_t hi, uint32_t bit, int neg)
 {
-	node_t *arg = call->call.vargs;
+	if (lo == hi) {
+		if (neg)
+			g->not_chars[lo] |= bit;
+		else
+			g->chars[lo] |= bit;
+		return 0;
+	}
 
-	emit_stack_zero(prog, call);
+	if (g->n_ranges == GLOB_RANGES_MAX || lo > hi)
+		return -EINVAL;
 
-	emit(prog, MOV(BPF_REG_1, BPF_REG_10));
-	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_1, call->dyn.addr));
-	emit(prog, MOV_IMM(BPF_REG_2, arch_reg_width()));
-	emit(prog, MOV(BPF_REG_3, BPF_REG_9));
-	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_3, sizeof(uintptr_t)*arg->integer));
-	emit(prog, CALL(BPF_FUNC_probe_read));
+	g->ranges[g->n_ranges].lo  = lo;
+	g->ranges[g->n_ranges].hi  = hi;
+	g->ranges[g->n_ranges].bit = bit;
+	g->ranges[g->n_ranges].neg = neg;
+	g->n_ranges++;
+	return 0;
+}
+
+static int glob_parse(glob_t *g, const char *p)
+{
+	const char *first;
+	uint32_t bit;
+	uint8_t lo;
+	int neg;
+
+	memset(g, 0, sizeof(*g));
+
+	for (; *p; p++) {
+		/* runs of stars are equivalent to a single one */
+		if (*p == '*' && g->n_tokens &&
+		    (g->star & (1 << (g->n_tokens - 1))))
+			continue;
+
+		if (g->n_tokens == GLOB_TOKENS_MAX)
+			return -E2BIG;
+
+		bit = 1 << (g->n_tokens + 1);
 
-	if (call->dyn.loc == LOC_REG) {
-		dyn_t src;
+		switch (*p) {
+		case '*':
+			g->star |= bit >> 1;
+			break;
+		case '?':
+			g->any |= bit;
+			break;
+		case '[':
+			neg = (p[1] == '!' || p[1] == '^');
+			if (neg) {
+				g->any |= bit;
+				p++;
+			}
+
+			/* a leading ] is a member, not the end */
+			for (first = ++p; *p && (*p != ']' || p == first); p++) {
+				lo = *p;
+				if (p[1] == '-' && p[2] && p[2] != ']') {
+					p += 2;
+					if (glob_range(g, lo, *p, bit, neg))
+						return -EINVAL;
+				} else {
+					glob_range(g, lo, lo, bit, neg);
+				}
+			}
+
+			if (!*p)
+				return -EINVAL;
+			break;
+		case '\\':
+			if (p[1])
+				p++;
+			/* fall-through */
+		default:
+			g->chars[(uint8_t)*p] |= bit;
+			break;
+		}
 
-		src = call->dyn;
-		src.loc = LOC_STACK;
-		return emit_xfer_dyns(prog, &call->dyn, &src);
+		g->n_tokens++;
 	}
 
 	return 0;
 }
 
-static int reg_loc_assign(node_t *call)
+/* the same automaton as match_compile generates, used to fold
+ * literals so that they match exactly like strings at run-time. */
+static int glob_match(const glob_t *g, const char *s)
+{
+	uint32_t state, accept;
+	uint8_t c;
+	int i;
+
+	state = 1 | ((g->star & 1) << 1);
+
+	for (; *s && state; s++) {
+		c = *s;
+
+		accept = (g->any | g->chars[c]) & ~g->not_chars[c];
+		for (i = 0; i < g->n_ranges; i++) {
+			if (c < g->ranges[i].lo || c > g->ranges[i].hi)
+				continue;
+
+			if (g->ranges[i].neg)
+				accept &= ~g->ranges[i].bit;
+			else
+				accept |= g->ranges[i].bit;
+		}
+
+		state = ((state << 1) & accept) | (state & g->star);
+		state |= (state & g->star) << 1;
+	}
+
+	return (state >> g->n_tokens) & 1;
+}
+
+static int match_compile(node_t *call, prog_t *prog)
+{
+	node_t *s = call->call.vargs, *pattern = s->next;
+	size_t *jmps, n_jmps = 0, i, done;
+	uint32_t state;
+	glob_t g;
+	int c;
+
+	glob_parse(&g, pattern->string);
+
+	if (s->type == TYPE_STR) {
+		emit(prog, MOV_IMM(BPF_REG_0, glob_match(&g, s->string)));
+		return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+	}
+
+	jmps = calloc(2 * s->dyn.size, sizeof(*jmps));
+	assert(jmps);
+
+	/* r0: current byte, r1: state, r2: tokens accepting r0 */
+	state = 1 | ((g.star & 1) << 1);
+	emit(prog, MOV_IMM(BPF_REG_1, state));
+
+	for (i = 0; i < s->dyn.size; i++) {
+		emit(prog, LDXB(BPF_REG_0, s->dyn.addr + i, mem_base(s->dyn.addr)));
+
+		/* the buffer may move as it grows, keep offsets */
+		jmps[n_jmps++] = prog->ip - prog->insns;
+		emit(prog, JMP_IMM(JMP_JEQ, BPF_REG_0, 0, 0));
+
+		emit(prog, MOV_IMM(BPF_REG_2, g.any));
+		for (c = 1; c < 256; c++) {
+			if (g.chars[c]) {
+				emit(prog, JMP_IMM(JMP_JNE, BPF_REG_0, c, 1));
+				emit(prog, ALU_IMM(ALU_OP_OR, BPF_REG_2, g.chars[c]));
+			}
+
+			if (g.not_chars[c]) {
+				emit(prog, JMP_IMM(JMP_JNE, BPF_REG_0, c, 1));
+				emit(prog, ALU_IMM(ALU_OP_AND, BPF_REG_2, ~g.not_chars[c]));
+			}
+		}
+
+		for (c = 0; c < g.n_ranges; c++) {
+			emit(prog, MOV(BPF_REG_3, BPF_REG_0));
+			emit(prog, ALU_IMM(ALU_OP_SUB, BPF_REG_3, g.ranges[c].lo));
+			emit(prog, JMP_IMM(JMP_JGT, BPF_REG_3,
+					   g.ranges[c].hi - g.ranges[c].lo, 1));
+
+			if (g.ranges[c].neg)
+				emit(prog, ALU_IMM(ALU_OP_AND, BPF_REG_2,
+						   ~g.ranges[c].bit));
+			else
+				emit(prog, ALU_IMM(ALU_OP_OR, BPF_REG_2,
+						   g.ranges[c].bit));
+		}
+
+		/* state = ((state << 1) & accepting) | (state & stars),
+		 * followed by the stars' epsilon moves. */
+		emit(prog, MOV(BPF_REG_3, BPF_REG_1));
+		emit(prog, ALU_IMM(ALU_OP_LSH, BPF_REG_3, 1));
+		emit(prog, ALU(ALU_OP_AND, BPF_REG_3, BPF_REG_2));
+		emit(prog, ALU_IMM(ALU_OP_AND, BPF_REG_1, g.star));
+		emit(prog, ALU(ALU_OP_OR, BPF_REG_1, BPF_REG_3));
+
+		if (g.star) {
+			emit(prog, MOV(BPF_REG_3, BPF_REG_1));
+			emit(prog, ALU_IMM(ALU_OP_AND, BPF_REG_3, g.star));
+			emit(prog, ALU_IMM(ALU_OP_LSH, BPF_REG_3, 1));
+			emit(prog, ALU(ALU_OP_OR, BPF_REG_1, BPF_REG_3));
+		}
+
+		/* no way to match any more */
+		if (i + 1 < s->dyn.size) {
+			jmps[n_jmps++] = prog->ip - prog->insns;
+			emit(prog, JMP_IMM(JMP_JEQ, BPF_REG_1, 0, 0));
+		}
+	}
+
+	/* end of string, or of the buffer */
+	done = prog->ip - prog->insns;
+	for (i = 0; !prog->err && i < n_jmps; i++)
+		prog->insns[jmps[i]].off = done - jmps[i] - 1;
+
+	emit(prog, ALU_IMM(ALU_OP_RSH, BPF_REG_1, g.n_tokens));
+	emit(prog, ALU_IMM(ALU_OP_AND, BPF_REG_1, 1));
+	free(jmps);
+
+	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_1]);
+}
+
+static int match_loc_assign(node_t *call)
+{
+	node_t *probe = node_get_probe(call);
+	node_t *s = call->call.vargs, *pattern = s->next;
+
+	/* the pattern is compiled into the program */
+	pattern->dyn.loc = LOC_VIRTUAL;
+
+	if (s->type == TYPE_STR)
+		s->dyn.loc = LOC_VIRTUAL;
+	else
+		node_probe_mem_get(probe, s, s->dyn.size);
+
+	return 0;
+}
+
+static int match_annotate(node_t *call)
+{
+	node_t *s = call->call.vargs, *pattern;
+	glob_t g;
+
+	if (!s || s->dyn.type != TYPE_STR || !(pattern = s->next) ||
+	    pattern->type != TYPE_STR || pattern->next) {
+		_e("~ is used as: string-expression ~ \"pattern\"");
+		return -EINVAL;
+	}
+
+	if (glob_parse(&g, pattern->string)) {
+		_e("invalid pattern \"%s\", or longer than %d tokens",
+		   pattern->string, GLOB_TOKENS_MAX);
+		return -EINVAL;
+	}
+
+	call->dyn.type = TYPE_INT;
+	call->dyn.size = sizeof(int64_t);
+	return 0;
+}
+
+static int stack_compile(node_t *call, prog_t *prog)
+{
+	/* the context pointer is kept in r9 */
+	emit(prog, MOV(BPF_REG_1, BPF_REG_9));
+	emit_ld_mapfd(prog, BPF_REG_2, node_map_get_fd(call));
+	emit(prog, MOV_IMM(BPF_REG_3, 0));
+	emit(prog, CALL(BPF_FUNC_get_stackid));
+
+	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+}
+
+static int stack_annotate(node_t *call)
 {
-	node_t *probe;
+	node_t *script = node_get_script(call);
+	mdyn_t *mdyn;
+
+	if (call->call.vargs)
+		return -EINVAL;
+
+	/* all stack traces in a script are stored in one shared
+	 * stack map, setup by map_setup. */
+	for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next)
+		if (!strcmp(mdyn->map->string, "stack"))
+			break;
+
+	if (!mdyn) {
+		mdyn = calloc(1, sizeof(*mdyn));
+		assert(mdyn);
 
-	/* if the result is going to a register, allocate space on the
-	 * stack as a temporary location to probe_read to. */
-	if (call->dyn.loc == LOC_REG) {
-		probe = node_get_probe(call);
+		mdyn->map = call;
 
-		call->dyn.addr = node_probe_stack_get(probe, call->dyn.size);
+		if (!script->dyn.script.mdyns)
+			script->dyn.script.mdyns = mdyn;
+		else
+			insque_tail(mdyn, script->dyn.script.mdyns);
 	}
 
+	/* the stack id is an int, and can thus be used as a map key,
+	 * the actual stack is resolved when the map is dumped. */
+	call->dyn.type = TYPE_INT;
+	call->dyn.size = sizeof(int64_t);
+	call->dump = dump_stack;
+	return 0;
+}
+
+static int reg_compile(node_t *call, prog_t *prog)
+{
+	node_t *arg = call->call.vargs;
+	int dst = call->dyn.loc == LOC_REG ? call->dyn.reg : BPF_REG_0;
+	int size = arch_reg_width() == sizeof(uint32_t) ? BPF_W : BPF_DW;
+
+	/* the context (pt_regs) pointer is kept in r9, and the
+	 * verifier allows it to be read directly. */
+	emit(prog, INSN(BPF_LDX | BPF_SIZE(size) | BPF_MEM, dst, BPF_REG_9,
+			sizeof(uintptr_t) * arg->integer, 0));
+
+	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[dst]);
+}
+
+static int reg_loc_assign(node_t *call)
+{
 	call->call.vargs->dyn.loc = LOC_VIRTUAL;
 	return 0;
 }
@@ -341,10 +721,32 @@ static int retval_annotate(node_t *call)
 	return 0;
 }
 
+static int log2_subprog_emit(prog_t *prog, node_t *call)
+{
+	emit_log2_raw(prog, BPF_REG_0, BPF_REG_1);
+	emit(prog, EXIT);
+	return 0;
+}
+
+static const subprog_t log2_subprog = {
+	.name = "log2",
+	.emit = log2_subprog_emit,
+};
+
 static int log2_compile(node_t *call, prog_t *prog)
 {
 	node_t *num = call->call.vargs;
-	int src, dst;
+	int src, dst, err;
+
+	if (subprog_shared(prog, call)) {
+		emit_xfer_dyn(prog, &dyn_reg[BPF_REG_1], num);
+
+		err = emit_subprog_call(prog, &log2_subprog, call);
+		if (err)
+			return err;
+
+		return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+	}
 
 	src = (num->dyn.loc == LOC_REG) ? num->dyn.reg : BPF_REG_0;
 	emit_xfer_dyn(prog, &dyn_reg[src], num);
@@ -372,9 +774,16 @@ static int count_compile(node_t *call, prog_t *prog)
 {
 	node_t *map = call->parent->method.map;
 
-	emit(prog, LDXDW(BPF_REG_0, map->dyn.addr, BPF_REG_10));
+	if (node_map_is_scalar(map)) {
+		emit_scalar_addr(prog, BPF_REG_1, map);
+		emit(prog, MOV_IMM(BPF_REG_0, 1));
+		emit(prog, XADDDW(BPF_REG_1, 0, BPF_REG_0));
+		return 0;
+	}
+
+	emit(prog, LDXDW(BPF_REG_0, map->dyn.addr, mem_base(map->dyn.addr)));
 	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_0, 1));
-	emit(prog, STXDW(BPF_REG_10, map->dyn.addr, BPF_REG_0));
+	emit(prog, STXDW(mem_base(map->dyn.addr), map->dyn.addr, BPF_REG_0));
 	return 0;
 }
 
@@ -506,8 +915,8 @@ static void quantize_dump_one(FILE *fp, int log2, int64_t count, int64_t tot)
 	fputc('\n', fp);
 }
 
-static int64_t quantize_dump_seg(FILE *fp, node_t *map,
-				 void *data, int len, int64_t tot)
+static void quantize_dump_seg(FILE *fp, node_t *map,
+			      void *data, int len, int64_t tot)
 {
 	node_t *rec = map->map.rec;
 	size_t entry_size = rec->dyn.size + map->dyn.size;
@@ -535,7 +944,10 @@ static int64_t quantize_dump_seg(FILE *fp, node_t *map,
 	quantize_dump_one(fp, *log2, *count, tot);
 }
 
-static void quantize_dump(FILE *fp, node_t *map, void *data, int len)
+/* histograms are keyed by [c1, c2, bucket], print one table per
+ * distinct [c1, c2] */
+static void hist_dump(FILE *fp, node_t *map, void *data, int len,
+		      void (*dump_seg)(FILE *, node_t *, void *, int, int64_t))
 {
 	node_t *rec = map->map.rec;
 	size_t entry_size = rec->dyn.size + map->dyn.size;
@@ -556,14 +968,19 @@ static void quantize_dump(FILE *fp, node_t *map, void *data, int len)
 			seg_tot += *count;
 			seg_len++;
 		} else {
-			quantize_dump_seg(fp, map, seg_start, seg_len, seg_tot);
+			dump_seg(fp, map, seg_start, seg_len, seg_tot);
 			seg_tot = *count;
 			seg_len = 1;
 			seg_start = key;
 		}
 	}
 
-	quantize_dump_seg(fp, map, seg_start, seg_len, seg_tot);
+	dump_seg(fp, map, seg_start, seg_len, seg_tot);
+}
+
+static void quantize_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	hist_dump(fp, map, data, len, quantize_dump_seg);
 }
 
 static int quantize_loc_assign(node_t *call)
@@ -605,115 +1022,1296 @@ static int quantize_annotate(node_t *call)
 }
 
 
-#define BUILTIN_INT_VOID(_name) {			\
-		.name     = #_name,			\
-		.annotate = int_noargs_annotate,	\
-		.compile  = _name ## _compile,		\
-	}
-
-#define BUILTIN(_name) {			\
-		.name     = #_name,		\
-		.annotate = _name ## _annotate,	\
-		.compile  = _name ## _compile,	\
-	}
+/* llquantize() is a log-linear histogram, every power of two is
+ * split into 2^bits linear sub-buckets. values below 2^(bits + 1)
+ * get a bucket each, for larger values the bucket is
+ *
+ *   e * 2^bits + (x >> e), where e = log2(x) - (bits + 1)
+ *
+ * i.e. the exponent followed by the bits just below the leading
+ * one. negative values share bucket -1. */
+#define LOGLIN_BITS_MAX 6
+#define LOGLIN_BITS_DEF 3
 
-#define BUILTIN_LOC(_name) {				\
-		.name       = #_name,			\
-		.annotate   = _name ## _annotate,	\
-		.loc_assign = _name ## _loc_assign,	\
-		.compile    = _name ## _compile,	\
-	}
+static int loglin_compile(node_t *call, prog_t *prog)
+{
+	node_t *num = call->call.vargs;
+	int bits = num->next->integer;
 
-#define BUILTIN_ALIAS(_name, _real) {		\
-		.name     = #_name,		\
-		.annotate = _real ## _annotate,	\
-		.compile  = _real ## _compile,	\
-	}
+	emit_xfer_dyn(prog, &dyn_reg[BPF_REG_0], num);
+	emit(prog, MOV(BPF_REG_1, BPF_REG_0));
+	emit_log2_raw(prog, BPF_REG_2, BPF_REG_1);
 
-#define BUILTIN_ALIAS_LOC(_name, _real) {		\
-		.name       = #_name,		\
-		.annotate   = _real ## _annotate,	\
-		.loc_assign = _real ## _loc_assign,	\
-		.compile    = _real ## _compile,	\
-	}
+	emit(prog, JMP_IMM(JMP_JSGE, BPF_REG_0, 0, 2));
+	emit(prog, MOV_IMM(BPF_REG_0, -1));
+	emit(prog, JMP_IMM(JMP_JA, 0, 0, 6));
 
-static builtin_t builtins[] = {
-	BUILTIN_LOC(reg),
-	BUILTIN_LOC(arg),
-	BUILTIN_LOC(func),
-	BUILTIN_LOC(retval),
-	BUILTIN_ALIAS_LOC(probefunc, func),
+	emit(prog, ALU_IMM(ALU_OP_SUB, BPF_REG_2, bits + 1));
+	emit(prog, JMP_IMM(JMP_JSGE, BPF_REG_2, 0, 1));
+	emit(prog, MOV_IMM(BPF_REG_2, 0));
+	emit(prog, ALU(ALU_OP_RSH, BPF_REG_0, BPF_REG_2));
+	emit(prog, ALU_IMM(ALU_OP_LSH, BPF_REG_2, bits));
+	emit(prog, ALU(ALU_OP_ADD, BPF_REG_0, BPF_REG_2));
 
-	BUILTIN_LOC(printf),
-	BUILTIN_INT_VOID(  gid),
-	BUILTIN_INT_VOID(  uid),
-	BUILTIN_INT_VOID( tgid),
-	BUILTIN_INT_VOID(  pid),
-	BUILTIN_INT_VOID(nsecs),
-	BUILTIN_INT_VOID( secs),
-	BUILTIN_INT_VOID(  cpu),
+	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+}
 
-	BUILTIN(comm),
-	BUILTIN_ALIAS(execname, comm),
-	BUILTIN_LOC(count),
-	BUILTIN_LOC(quantize),
-	BUILTIN(log2),
+static int loglin_loc_assign(node_t *call)
+{
+	int err;
 
-	BUILTIN(strcmp),
+	err = default_loc_assign(call);
+	if (err)
+		return err;
 
-	{ .name = NULL }
-};
+	call->call.vargs->next->dyn.loc = LOC_VIRTUAL;
+	return 0;
+}
 
-static builtin_t *builtin_find(const char *name)
+static int loglin_annotate(node_t *call)
 {
-	builtin_t *bi;
-	
-	for (bi = builtins; bi->name; bi++)
-		if (!strcmp(bi->name, name))
-			return bi;
+	node_t *num = call->call.vargs, *bits = num ? num->next : NULL;
+
+	if (!bits || bits->next ||
+	    (num->dyn.type != TYPE_NONE && num->dyn.type != TYPE_INT) ||
+	    bits->type != TYPE_INT ||
+	    bits->integer < 0 || bits->integer > LOGLIN_BITS_MAX) {
+		_e("%s takes a number and a literal integer in the range [0, %d]",
+		   node_str(call), LOGLIN_BITS_MAX);
+		return -EINVAL;
+	}
 
+	call->dyn.type = TYPE_INT;
+	call->dyn.size = sizeof(int64_t);
 	return 0;
 }
 
-int builtin_compile(node_t *call, prog_t *prog)
+static void loglin_range(int64_t bucket, int bits, int64_t *lo, int64_t *hi)
 {
-	builtin_t *bi = builtin_find(call->string);
-
-	if (!bi) {
-		_e("unknown builin '%s'", call->string);
-		return -ENOENT;
-	}
+	int e = 0;
 
-	if (!bi->compile) {
-		_e("unable to compile '%s'", call->string);
-		return -ENOSYS;
-	}
+	if (bucket >= (2 << bits))
+		e = (bucket >> bits) - 1;
 
-	return bi->compile(call, prog);
+	*lo = (bucket - ((int64_t)e << bits)) << e;
+	*hi = *lo + (1LL << e) - 1;
 }
 
-static int default_loc_assign(node_t *call)
+static int llquantize_compile(node_t *call, prog_t *prog)
 {
-	node_t *probe = node_get_probe(call), *stmt = node_get_stmt(call);
-	node_t *varg;
-	int reg;
+	return count_compile(call, prog);
+}
 
-	node_foreach(varg, call->call.vargs) {
-		switch (varg->dyn.type) {
-		case TYPE_INT:
-			reg = node_stmt_reg_get(stmt);
-			if (reg > 0) {
-				varg->dyn.loc = LOC_REG;
-				varg->dyn.reg = reg;
-				continue;
-			}
-			/* no registers, fall-through and allocate on
-			 * the stack */
-		case TYPE_REC:
-		case TYPE_STR:
-			varg->dyn.loc  = LOC_STACK;
-			varg->dyn.addr = node_probe_stack_get(probe, varg->dyn.size);
-			continue;
+static void llquantize_dump_seg(FILE *fp, node_t *map,
+				void *data, int len, int64_t tot)
+{
+	static const int pmille[] = { 500, 900, 990, 999 };
+	static const char *pname[] = { "p50", "p90", "p99", "p999" };
+
+	node_t *rec = map->map.rec, *loglin;
+	size_t entry_size = rec->dyn.size + map->dyn.size;
+	size_t rec_size = rec->dyn.size - sizeof(int64_t);
+	int64_t *bucket = data + rec_size, *count = data + rec->dyn.size;
+	int64_t lo, hi, cum = 0, pval[4];
+	int bits, p = 0;
+
+	for (loglin = rec->rec.vargs; loglin->next; loglin = loglin->next);
+	bits = loglin->call.vargs->next->integer;
+
+	dump_rec(fp, rec, data, rec->rec.n_vargs - 1);
+	if (!map->map.is_var)
+		fputc('\n', fp);
+
+	for (; len > 0; len--) {
+		if (*bucket < 0) {
+			lo = hi = -1;
+			fputs("\t                 < 0", fp);
+		} else {
+			loglin_range(*bucket, bits, &lo, &hi);
+			fprintf(fp, "\t[%8" PRId64 ", %8" PRId64 "]", lo, hi);
+		}
+
+		fprintf(fp, "\t%8" PRId64 " ", *count);
+		if (G.ascii)
+			quantize_dump_bar_ascii(fp, *count, tot);
+		else
+			quantize_dump_bar(fp, *count, tot);
+		fputc('\n', fp);
+
+		/* upper bound of the bucket that reaches each
+		 * percentile */
+		cum += *count;
+		for (; p < 4 && cum * 1000 >= pmille[p] * tot; p++)
+			pval[p] = hi;
+
+		bucket = (void *)bucket + entry_size;
+		count = (void *)count + entry_size;
+	}
+
+	fputc('\t', fp);
+	for (p = 0; p < 4; p++)
+		fprintf(fp, "%s%s <= %" PRId64, p ? "  " : "", pname[p], pval[p]);
+	fputc('\n', fp);
+}
+
+static void llquantize_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	hist_dump(fp, map, data, len, llquantize_dump_seg);
+}
+
+static int llquantize_loc_assign(node_t *call)
+{
+	mdyn_t *mdyn;
+
+	mdyn = node_map_get_mdyn(call->parent->method.map);
+	mdyn->dump = llquantize_dump;
+	return default_loc_assign(call);
+}
+
+static int llquantize_annotate(node_t *call)
+{
+	node_t *map = call->parent->method.map;
+	node_t *num = call->call.vargs, *bits, *rec;
+
+	if (!num || (num->next && num->next->next) ||
+	    (num->dyn.type != TYPE_NONE && num->dyn.type != TYPE_INT) ||
+	    call->parent->type != TYPE_METHOD)
+		return -EINVAL;
+
+	bits = num->next;
+	if (!bits) {
+		bits = node_int_new(LOGLIN_BITS_DEF);
+		bits->dyn.type = TYPE_INT;
+		bits->dyn.size = sizeof(int64_t);
+		num->next = bits;
+	}
+
+	for (rec = map->map.rec->rec.vargs; rec->next; rec = rec->next);
+
+	/* rewrite map[c1, c2].llquantize(some_int, bits)
+	 * into    map[c1, c2, loglin(some_int, bits)].llquantize()
+	 */
+	rec->next = node_call_new(strdup("loglin"), num);
+	rec->next->parent = map->map.rec;
+	map->map.rec->rec.n_vargs++;
+	call->call.vargs = NULL;
+
+	call->dyn.type = TYPE_INT;
+	call->dyn.size = sizeof(int64_t);
+
+	/* the annotation pass has already visited the key */
+	return builtin_annotate(rec->next);
+}
+
+/* find the internal map `name`, creating it on first use */
+static mdyn_t *builtin_mdyn(node_t *script, const char *name)
+{
+	mdyn_t *mdyn;
+
+	for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next)
+		if (!strcmp(mdyn->map->string, name))
+			return mdyn;
+
+	mdyn = calloc(1, sizeof(*mdyn));
+	assert(mdyn);
+
+	mdyn->map = node_str_new(strdup(name));
+
+	if (!script->dyn.script.mdyns)
+		script->dyn.script.mdyns = mdyn;
+	else
+		insque_tail(mdyn, script->dyn.script.mdyns);
+
+	return mdyn;
+}
+
+/* pointer to the value of map in r0, for aggregations that update
+ * it in place. a missing key is created from a zeroed stack copy. */
+static void value_addr_emit(prog_t *prog, node_t *map)
+{
+	ssize_t key = map->map.rec->dyn.addr;
+	size_t found;
+
+	if (node_map_is_scalar(map)) {
+		emit_scalar_addr(prog, BPF_REG_0, map);
+		return;
+	}
+
+	emit_map_lookup_raw(prog, node_map_get_fd(map), key);
+
+	found = prog->ip - prog->insns;
+	emit(prog, JMP_IMM(JMP_JNE, BPF_REG_0, 0, 0));
+
+	/* another CPU may have created the key, and started updating
+	 * it, since the lookup. never overwrite it with zeroes, just
+	 * look it up again. */
+	emit_stack_zero(prog, map);
+	emit_map_update_raw(prog, node_map_get_fd(map), key, map->dyn.addr,
+			    BPF_NOEXIST);
+	emit_map_lookup_raw(prog, node_map_get_fd(map), key);
+	emit(prog, JMP_IMM(JMP_JNE, BPF_REG_0, 0, 2));
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, EXIT);
+
+	if (!prog->err)
+		prog->insns[found].off = (prog->ip - prog->insns) - found - 1;
+}
+
+/* distinct() estimates the number of distinct values it has seen
+ * with a HyperLogLog sketch. the value of each key holds one byte
+ * register per bucket; the low bits of a 64-bit hash of the argument
+ * select the bucket, which keeps the highest rank, i.e. the position
+ * of the first set bit, of the remaining bits it has seen. */
+#define HLL_BITS 7
+#define HLL_REGS (1 << HLL_BITS)
+
+/* murmur3's 64-bit finalizer, hash in r0, clobbers r2 */
+static void hash_mix_emit(prog_t *prog)
+{
+	emit(prog, MOV(BPF_REG_2, BPF_REG_0));
+	emit(prog, ALU_IMM(ALU_OP_RSH, BPF_REG_2, 33));
+	emit(prog, ALU(ALU_OP_XOR, BPF_REG_0, BPF_REG_2));
+	emit_ld_imm64(prog, BPF_REG_2, 0xff51afd7ed558ccdULL);
+	emit(prog, ALU(ALU_OP_MUL, BPF_REG_0, BPF_REG_2));
+	emit(prog, MOV(BPF_REG_2, BPF_REG_0));
+	emit(prog, ALU_IMM(ALU_OP_RSH, BPF_REG_2, 33));
+	emit(prog, ALU(ALU_OP_XOR, BPF_REG_0, BPF_REG_2));
+	emit_ld_imm64(prog, BPF_REG_2, 0xc4ceb9fe1a85ec53ULL);
+	emit(prog, ALU(ALU_OP_MUL, BPF_REG_0, BPF_REG_2));
+	emit(prog, MOV(BPF_REG_2, BPF_REG_0));
+	emit(prog, ALU_IMM(ALU_OP_RSH, BPF_REG_2, 33));
+	emit(prog, ALU(ALU_OP_XOR, BPF_REG_0, BPF_REG_2));
+}
+
+/* hash expr into r0, clobbers r1 and r2. strings and records are
+ * folded in a word at a time, see hash_mem. */
+static void hash_emit(prog_t *prog, node_t *expr)
+{
+	size_t off, n;
+
+	if (expr->dyn.type == TYPE_INT) {
+		emit_xfer_dyn(prog, &dyn_reg[BPF_REG_0], expr);
+		hash_mix_emit(prog);
+		return;
+	}
+
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	for (off = 0; off < expr->dyn.size; off += sizeof(uint64_t)) {
+		n = expr->dyn.size - off;
+		strcmp_load(prog, expr, BPF_REG_1, off,
+			    n < sizeof(uint64_t) ? n : sizeof(uint64_t));
+		emit(prog, ALU(ALU_OP_XOR, BPF_REG_0, BPF_REG_1));
+		hash_mix_emit(prog);
+	}
+}
+
+static uint64_t hash_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* the same hash as hash_emit, of a string or record */
+static uint64_t hash_mem(const void *data, size_t size)
+{
+	uint64_t h = 0, word;
+	size_t off, n;
+
+	for (off = 0; off < size; off += sizeof(word)) {
+		n = size - off;
+		word = 0;
+		memcpy(&word, data + off, n < sizeof(word) ? n : sizeof(word));
+		h = hash_mix(h ^ word);
+	}
+
+	return h;
+}
+
+static int distinct_compile(node_t *call, prog_t *prog)
+{
+	value_addr_emit(prog, call->parent->method.map);
+
+	/* r4: registers, r3: bucket, r1: rank */
+	emit(prog, MOV(BPF_REG_4, BPF_REG_0));
+	hash_emit(prog, call->call.vargs);
+
+	emit(prog, MOV(BPF_REG_3, BPF_REG_0));
+	emit(prog, ALU_IMM(ALU_OP_AND, BPF_REG_3, HLL_REGS - 1));
+	emit(prog, ALU_IMM(ALU_OP_RSH, BPF_REG_0, HLL_BITS));
+	emit_log2_raw(prog, BPF_REG_2, BPF_REG_0);
+	emit(prog, MOV_IMM(BPF_REG_1, 64 - HLL_BITS + 1));
+	emit(prog, ALU(ALU_OP_SUB, BPF_REG_1, BPF_REG_2));
+
+	emit(prog, ALU(ALU_OP_ADD, BPF_REG_4, BPF_REG_3));
+	emit(prog, LDXB(BPF_REG_2, 0, BPF_REG_4));
+	emit(prog, JMP(JMP_JGE, BPF_REG_2, BPF_REG_1, 1));
+	emit(prog, STXB(BPF_REG_4, 0, BPF_REG_1));
+	return 0;
+}
+
+static uint64_t distinct_estimate(const uint8_t *regs)
+{
+	double m = HLL_REGS, sum = 0, est;
+	int i, zeros = 0;
+
+	for (i = 0; i < HLL_REGS; i++) {
+		sum += ldexp(1.0, -regs[i]);
+		if (!regs[i])
+			zeros++;
+	}
+
+	est = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+
+	/* few values seen, linear counting is more accurate */
+	if (est <= 2.5 * m && zeros)
+		est = m * log(m / zeros);
+
+	return est + 0.5;
+}
+
+static void distinct_dump(FILE *fp, node_t *map, void *data)
+{
+	fprintf(fp, "%8" PRIu64, distinct_estimate(data));
+}
+
+static int distinct_cmp(node_t *map, const void *a, const void *b)
+{
+	uint64_t ea = distinct_estimate(a), eb = distinct_estimate(b);
+
+	return (ea > eb) - (ea < eb);
+}
+
+static int distinct_loc_assign(node_t *call)
+{
+	mdyn_t *mdyn;
+
+	mdyn = node_map_get_mdyn(call->parent->method.map);
+	mdyn->map->dump = distinct_dump;
+	mdyn->map->cmp = distinct_cmp;
+	mdyn->cmp = count_cmp;
+	return default_loc_assign(call);
+}
+
+static int distinct_annotate(node_t *call)
+{
+	node_t *expr = call->call.vargs;
+
+	if (!expr || expr->next ||
+	    call->parent->type != TYPE_METHOD)
+		return -EINVAL;
+
+	call->dyn.type = TYPE_STR;
+	call->dyn.size = HLL_REGS;
+	return 0;
+}
+
+
+/* sum(), min(), max(), avg() and stats() all keep the same summary
+ * of their argument, and differ only in what is shown. the count and
+ * sums are added atomically; min and max may miss an update that
+ * races with another CPU.
+ *
+ * the sum of squares overflows quickly, e.g. after 18 values of one
+ * second in ns. once it has, sq_ovf is set and no standard deviation
+ * is reported. */
+typedef struct stats {
+	int64_t  count;
+	int64_t  sum;
+	uint64_t sum_sq;
+	int64_t  sq_ovf;
+	int64_t  min;
+	int64_t  max;
+} stats_t;
+
+#define STATS_SQ_MAX 0xffffffffLL
+
+enum {
+	STATS_NONE,
+	STATS_SUM,
+	STATS_MIN,
+	STATS_MAX,
+	STATS_AVG,
+	STATS_ALL,
+};
+
+static const char *stats_aggs[] = {
+	[STATS_SUM] = "sum",
+	[STATS_MIN] = "min",
+	[STATS_MAX] = "max",
+	[STATS_AVG] = "avg",
+	[STATS_ALL] = "stats",
+};
+
+static int stats_compile(node_t *call, prog_t *prog)
+{
+	value_addr_emit(prog, call->parent->method.map);
+
+	/* r1: summary, r3: value */
+	emit(prog, MOV(BPF_REG_1, BPF_REG_0));
+	emit_xfer_dyn(prog, &dyn_reg[BPF_REG_3], call->call.vargs);
+
+	emit(prog, LDXDW(BPF_REG_2, offsetof(stats_t, count), BPF_REG_1));
+	emit(prog, MOV_IMM(BPF_REG_4, 1));
+	emit(prog, XADDDW(BPF_REG_1, offsetof(stats_t, count), BPF_REG_4));
+	emit(prog, XADDDW(BPF_REG_1, offsetof(stats_t, sum), BPF_REG_3));
+	emit(prog, MOV(BPF_REG_4, BPF_REG_3));
+	emit(prog, ALU(ALU_OP_MUL, BPF_REG_4, BPF_REG_3));
+
+	/* the square itself, or the sum, would wrap */
+	emit_ld_imm64(prog, BPF_REG_0, STATS_SQ_MAX);
+	emit(prog, JMP(JMP_JSGT, BPF_REG_3, BPF_REG_0, 8));
+	emit_ld_imm64(prog, BPF_REG_0, -STATS_SQ_MAX);
+	emit(prog, JMP(JMP_JSGT, BPF_REG_0, BPF_REG_3, 5));
+	emit(prog, LDXDW(BPF_REG_5, offsetof(stats_t, sum_sq), BPF_REG_1));
+	emit(prog, ALU(ALU_OP_ADD, BPF_REG_5, BPF_REG_4));
+	emit(prog, JMP(JMP_JGT, BPF_REG_4, BPF_REG_5, 2));
+	emit(prog, XADDDW(BPF_REG_1, offsetof(stats_t, sum_sq), BPF_REG_4));
+	emit(prog, JMP_IMM(JMP_JA, 0, 0, 2));
+	emit(prog, MOV_IMM(BPF_REG_4, 1));
+	emit(prog, STXDW(BPF_REG_1, offsetof(stats_t, sq_ovf), BPF_REG_4));
+
+	/* the first value is both the min and the max */
+	emit(prog, JMP_IMM(JMP_JNE, BPF_REG_2, 0, 3));
+	emit(prog, STXDW(BPF_REG_1, offsetof(stats_t, min), BPF_REG_3));
+	emit(prog, STXDW(BPF_REG_1, offsetof(stats_t, max), BPF_REG_3));
+	emit(prog, JMP_IMM(JMP_JA, 0, 0, 6));
+
+	emit(prog, LDXDW(BPF_REG_4, offsetof(stats_t, min), BPF_REG_1));
+	emit(prog, JMP(JMP_JSGE, BPF_REG_3, BPF_REG_4, 1));
+	emit(prog, STXDW(BPF_REG_1, offsetof(stats_t, min), BPF_REG_3));
+	emit(prog, LDXDW(BPF_REG_4, offsetof(stats_t, max), BPF_REG_1));
+	emit(prog, JMP(JMP_JSGE, BPF_REG_4, BPF_REG_3, 1));
+	emit(prog, STXDW(BPF_REG_1, offsetof(stats_t, max), BPF_REG_3));
+	return 0;
+}
+
+static int64_t stats_value(const stats_t *s, int agg)
+{
+	switch (agg) {
+	case STATS_SUM:
+		return s->sum;
+	case STATS_MIN:
+		return s->min;
+	case STATS_MAX:
+		return s->max;
+	default:
+		return s->count ? s->sum / s->count : 0;
+	}
+}
+
+static void stats_dump(FILE *fp, node_t *map, void *data)
+{
+	mdyn_t *mdyn = node_map_get_mdyn(map);
+	const stats_t *s = data;
+	double mean, var = 0;
+
+	if (mdyn->agg != STATS_ALL) {
+		fprintf(fp, "%8" PRId64, stats_value(s, mdyn->agg));
+		return;
+	}
+
+	fprintf(fp, "count %8" PRId64 "  avg %8" PRId64 "  min %8" PRId64
+		"  max %8" PRId64 "  stddev ", s->count,
+		stats_value(s, STATS_AVG), s->min, s->max);
+
+	if (s->sq_ovf) {
+		fprintf(fp, "%8s", "-");
+		return;
+	}
+
+	if (s->count) {
+		mean = (double)s->sum / s->count;
+		var  = (double)s->sum_sq / s->count - mean * mean;
+	}
+
+	fprintf(fp, "%8.0f", var > 0 ? sqrt(var) : 0);
+}
+
+static int stats_cmp(node_t *map, const void *a, const void *b)
+{
+	mdyn_t *mdyn = node_map_get_mdyn(map);
+	int64_t va = stats_value(a, mdyn->agg), vb = stats_value(b, mdyn->agg);
+
+	return (va > vb) - (va < vb);
+}
+
+static int stats_loc_assign(node_t *call)
+{
+	mdyn_t *mdyn;
+	int agg;
+
+	mdyn = node_map_get_mdyn(call->parent->method.map);
+
+	for (agg = STATS_SUM; agg < STATS_ALL; agg++)
+		if (!strcmp(call->string, stats_aggs[agg]))
+			break;
+
+	/* each call adds to the summary, mixing them would count
+	 * every value twice */
+	if (mdyn->agg && mdyn->agg != agg) {
+		_e("%s: both %s() and %s() used, use stats() to get all of them",
+		   mdyn->map->string, stats_aggs[mdyn->agg], stats_aggs[agg]);
+		return -EINVAL;
+	}
+
+	mdyn->agg = agg;
+	mdyn->map->dump = stats_dump;
+	mdyn->map->cmp = stats_cmp;
+	mdyn->cmp = count_cmp;
+	return default_loc_assign(call);
+}
+
+static int stats_annotate(node_t *call)
+{
+	node_t *expr = call->call.vargs;
+
+	if (!expr || expr->next ||
+	    (expr->dyn.type != TYPE_NONE && expr->dyn.type != TYPE_INT) ||
+	    call->parent->type != TYPE_METHOD)
+		return -EINVAL;
+
+	call->dyn.type = TYPE_STR;
+	call->dyn.size = sizeof(stats_t);
+	return 0;
+}
+
+/* topk(k) tracks the k most frequent keys of a map, without needing
+ * room for every key. each event is counted in a count-min sketch,
+ * TOPK_DEPTH rows of TOPK_WIDTH counters each indexed by a part of
+ * the key's hash, kept per CPU in the shared "topk" map. the map
+ * itself is an LRU of candidates, frequent keys are refreshed often
+ * enough to stay in it. the sketches of all CPUs are merged when the
+ * map is dumped, and each candidate is estimated by its smallest
+ * counter. */
+#define TOPK_DEPTH  4
+#define TOPK_BITS   9
+#define TOPK_WIDTH  (1 << TOPK_BITS)
+#define TOPK_SKETCH (TOPK_DEPTH * TOPK_WIDTH * sizeof(uint32_t))
+
+/* per-CPU values are limited to 32k */
+#define TOPK_SKETCH_MAX (32 << 10)
+
+static int topk_compile(node_t *call, prog_t *prog)
+{
+	node_t *map = call->parent->method.map;
+	mdyn_t *mdyn = node_map_get_mdyn(map);
+	ssize_t val = map->dyn.addr;
+	size_t out;
+	int d;
+
+	/* the value is overwritten with the estimate, stash the hash
+	 * there until then. */
+	hash_emit(prog, map->map.rec);
+	emit(prog, STXDW(mem_base(val), val, BPF_REG_0));
+
+	emit(prog, STW_IMM(BPF_REG_10, call->dyn.addr, 0));
+	emit_map_lookup_raw(prog, mdyn->topk_sketch->mapfd, call->dyn.addr);
+	out = prog->ip - prog->insns;
+	emit(prog, JMP_IMM(JMP_JEQ, BPF_REG_0, 0, 0));
+
+	/* r0: sketch, r1: hash, r4: smallest counter */
+	emit(prog, LDXDW(BPF_REG_1, val, mem_base(val)));
+	emit(prog, MOV_IMM(BPF_REG_4, -1));
+
+	for (d = 0; d < TOPK_DEPTH; d++) {
+		emit(prog, MOV(BPF_REG_2, BPF_REG_1));
+		emit(prog, ALU_IMM(ALU_OP_RSH, BPF_REG_2, d * TOPK_BITS));
+		emit(prog, ALU_IMM(ALU_OP_AND, BPF_REG_2, TOPK_WIDTH - 1));
+		emit(prog, ALU_IMM(ALU_OP_LSH, BPF_REG_2, 2));
+		emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_2, mdyn->topk_off +
+				   d * TOPK_WIDTH * sizeof(uint32_t)));
+		emit(prog, MOV(BPF_REG_3, BPF_REG_0));
+		emit(prog, ALU(ALU_OP_ADD, BPF_REG_3, BPF_REG_2));
+
+		emit(prog, INSN(BPF_LDX | BPF_SIZE(BPF_W) | BPF_MEM,
+				BPF_REG_2, BPF_REG_3, 0, 0));
+		emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_2, 1));
+		emit(prog, INSN(BPF_STX | BPF_SIZE(BPF_W) | BPF_MEM,
+				BPF_REG_3, BPF_REG_2, 0, 0));
+
+		emit(prog, JMP(JMP_JGE, BPF_REG_2, BPF_REG_4, 1));
+		emit(prog, MOV(BPF_REG_4, BPF_REG_2));
+	}
+
+	emit(prog, STXDW(mem_base(val), val, BPF_REG_4));
+
+	if (!prog->err)
+		prog->insns[out].off = (prog->ip - prog->insns) - out - 1;
+	return 0;
+}
+
+static int topk_entry_cmp(const void *a, const void *b, void *_rec)
+{
+	node_t *rec = _rec;
+	int64_t ea = *(int64_t *)(a + rec->dyn.size);
+	int64_t eb = *(int64_t *)(b + rec->dyn.size);
+
+	return (eb > ea) - (eb < ea);
+}
+
+static void topk_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	mdyn_t *mdyn = node_map_get_mdyn(map);
+	node_t *rec = map->map.rec;
+	size_t entry_size = rec->dyn.size + map->dyn.size;
+	size_t sketch_size = mdyn->topk_sketch->map->dyn.size;
+	uint64_t counts[TOPK_DEPTH * TOPK_WIDTH] = { 0 }, h, n = 0;
+	uint32_t key = 0, *cpu;
+	int64_t *est;
+	void *vals, *entry;
+	int i, c, d, n_cpus;
+
+	vals = map_lookup_percpu(mdyn->topk_sketch->mapfd, &key,
+				 sketch_size, &n_cpus);
+	if (!vals) {
+		_pe("%s: unable to read sketch", map->string);
+		return;
+	}
+
+	for (c = 0; c < n_cpus; c++) {
+		cpu = vals + c * _ALIGNED(sketch_size) + mdyn->topk_off;
+		for (i = 0; i < TOPK_DEPTH * TOPK_WIDTH; i++)
+			counts[i] += cpu[i];
+	}
+	free(vals);
+
+	for (i = 0; i < TOPK_WIDTH; i++)
+		n += counts[i];
+
+	for (i = 0, entry = data; i < len; i++, entry += entry_size) {
+		h = hash_mem(entry, rec->dyn.size);
+		est = entry + rec->dyn.size;
+		*est = INT64_MAX;
+
+		for (d = 0; d < TOPK_DEPTH; d++) {
+			c = (h >> (d * TOPK_BITS)) & (TOPK_WIDTH - 1);
+			if ((int64_t)counts[d * TOPK_WIDTH + c] < *est)
+				*est = counts[d * TOPK_WIDTH + c];
+		}
+	}
+
+	qsort_r(data, len, entry_size, topk_entry_cmp, rec);
+
+	for (i = 0, entry = data; i < len && i < mdyn->topk; i++, entry += entry_size) {
+		dump_rec(fp, rec, entry, rec->rec.n_vargs);
+		fprintf(fp, "\t%8" PRId64 "\n", *(int64_t *)(entry + rec->dyn.size));
+	}
+
+	/* each counter is off by at most e/width of all events, in
+	 * all rows at once with a probability of e^-depth */
+	fprintf(fp, "(of %" PRIu64 " events, each count may be %" PRIu64
+		" too high, %.0f%% confidence)\n", n,
+		(uint64_t)ceil(M_E * n / TOPK_WIDTH),
+		100.0 * (1.0 - exp(-TOPK_DEPTH)));
+}
+
+static int topk_loc_assign(node_t *call)
+{
+	node_t *probe = node_get_probe(call);
+	node_t *map = call->parent->method.map;
+	mdyn_t *mdyn = node_map_get_mdyn(map), *sketch;
+
+	call->call.vargs->dyn.loc = LOC_VIRTUAL;
+
+	/* the key of the sketch map is bounced via the stack */
+	call->dyn.addr = node_probe_stack_get(probe, call, sizeof(int64_t));
+	if (call->dyn.addr >= 0 || call->dyn.addr < -STACK_MAX) {
+		_e("%s: out of stack space", node_str(call));
+		return -ENOSPC;
+	}
+
+	if (call->call.vargs->integer > mdyn->topk)
+		mdyn->topk = call->call.vargs->integer;
+
+	if (mdyn->topk_sketch)
+		return 0;
+
+	sketch = builtin_mdyn(node_get_script(call), "topk");
+	if (sketch->map->dyn.size + TOPK_SKETCH > TOPK_SKETCH_MAX) {
+		_e("%s: at most %d maps may use topk()", map->string,
+		   (int)(TOPK_SKETCH_MAX / TOPK_SKETCH));
+		return -ENOSPC;
+	}
+
+	mdyn->topk_sketch = sketch;
+	mdyn->topk_off = sketch->map->dyn.size;
+	sketch->map->dyn.size += TOPK_SKETCH;
+
+	mdyn->dump = topk_dump;
+	return 0;
+}
+
+static int topk_annotate(node_t *call)
+{
+	node_t *map = call->parent->method.map;
+	node_t *k = call->call.vargs;
+
+	if (call->parent->type != TYPE_METHOD)
+		return -EINVAL;
+
+	if (!k || k->next || k->type != TYPE_INT ||
+	    k->integer <= 0 || k->integer > MAP_LEN) {
+		_e("%s takes a literal integer in the range [1, %d]",
+		   node_str(call), MAP_LEN);
+		return -EINVAL;
+	}
+
+	if (node_map_is_scalar(map)) {
+		_e("%s: topk() needs a keyed map", map->string);
+		return -EINVAL;
+	}
+
+	call->dyn.type = TYPE_INT;
+	call->dyn.size = sizeof(int64_t);
+	return 0;
+}
+
+
+/* sample() and ratelimit() keep per-CPU state, 16 bytes per call
+ * site, in the single value of a shared per-CPU array. */
+#define SAMPLE_STATE_SIZE (2 * sizeof(int64_t))
+
+static int sample_site_annotate(node_t *call, int64_t max)
+{
+	node_t *script = node_get_script(call);
+	node_t *arg = call->call.vargs, *off;
+	mdyn_t *mdyn;
+
+	if (!arg || arg->next || arg->type != TYPE_INT ||
+	    arg->integer <= 0 || arg->integer > max) {
+		_e("%s takes a literal integer in the range [1, %" PRId64 "]",
+		   node_str(call), max);
+		return -EINVAL;
+	}
+
+	mdyn = builtin_mdyn(script, "sample");
+
+	/* rewrite sample(n)
+	 * into    sample(n, <offset of state>)
+	 */
+	off = node_int_new(mdyn->map->dyn.size);
+	off->dyn.type = TYPE_INT;
+	off->dyn.size = sizeof(int64_t);
+	off->parent = call;
+	arg->next = off;
+	mdyn->map->dyn.size += SAMPLE_STATE_SIZE;
+
+	call->dyn.type = TYPE_INT;
+	call->dyn.size = sizeof(int64_t);
+	return 0;
+}
+
+static int sample_loc_assign(node_t *call)
+{
+	node_t *probe = node_get_probe(call);
+	node_t *varg;
+
+	node_foreach(varg, call->call.vargs)
+		varg->dyn.loc = LOC_VIRTUAL;
+
+	/* the map key, and later a spilled pointer to the state,
+	 * are bounced via the stack. */
+	if (call->dyn.loc == LOC_REG)
+		call->dyn.addr = node_probe_stack_get(probe, call,
+						      sizeof(int64_t));
+
+	if (call->dyn.loc == LOC_SCRATCH ||
+	    call->dyn.addr >= 0 || call->dyn.addr < -STACK_MAX) {
+		_e("%s: out of stack space", node_str(call));
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+static int sample_lookup(node_t *call, prog_t *prog)
+{
+	mdyn_t *mdyn = builtin_mdyn(node_get_script(call), "sample");
+
+	emit(prog, STW_IMM(BPF_REG_10, call->dyn.addr, 0));
+	emit_map_lookup_raw(prog, mdyn->mapfd, call->dyn.addr);
+	return 0;
+}
+
+/* 1 for every n:th event on each CPU, otherwise 0 */
+static int sample_compile(node_t *call, prog_t *prog)
+{
+	int64_t n = call->call.vargs->integer;
+	int16_t off = call->call.vargs->next->integer;
+
+	sample_lookup(call, prog);
+	emit(prog, JMP_IMM(JMP_JEQ, BPF_REG_0, 0, 8));
+
+	/* count down to zero, then reload */
+	emit(prog, LDXDW(BPF_REG_1, off, BPF_REG_0));
+	emit(prog, MOV_IMM(BPF_REG_2, 0));
+	emit(prog, JMP_IMM(JMP_JNE, BPF_REG_1, 0, 2));
+	emit(prog, MOV_IMM(BPF_REG_1, n));
+	emit(prog, MOV_IMM(BPF_REG_2, 1));
+	emit(prog, ALU_IMM(ALU_OP_SUB, BPF_REG_1, 1));
+	emit(prog, STXDW(BPF_REG_0, off, BPF_REG_1));
+	emit(prog, MOV(BPF_REG_0, BPF_REG_2));
+
+	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+}
+
+static int sample_annotate(node_t *call)
+{
+	return sample_site_annotate(call, INT32_MAX);
+}
+
+#define NSEC_PER_SEC 1000000000
+
+/* a token bucket per CPU, refilled at n tokens per second, holding
+ * at most one second worth of them. tokens are kept in units of
+ * 1/NSEC_PER_SEC to avoid any division. */
+static int ratelimit_compile(node_t *call, prog_t *prog)
+{
+	int64_t n = call->call.vargs->integer;
+	int16_t off = call->call.vargs->next->integer;
+
+	sample_lookup(call, prog);
+	emit(prog, JMP_IMM(JMP_JEQ, BPF_REG_0, 0, 23));
+
+	emit(prog, STXDW(BPF_REG_10, call->dyn.addr, BPF_REG_0));
+	emit(prog, CALL(BPF_FUNC_ktime_get_ns));
+	emit(prog, LDXDW(BPF_REG_1, call->dyn.addr, BPF_REG_10));
+
+	/* r0 = time since last event, at most one second */
+	emit(prog, LDXDW(BPF_REG_2, off + sizeof(int64_t), BPF_REG_1));
+	emit(prog, STXDW(BPF_REG_1, off + sizeof(int64_t), BPF_REG_0));
+	emit(prog, ALU(ALU_OP_SUB, BPF_REG_0, BPF_REG_2));
+	emit(prog, JMP_IMM(JMP_JGT, BPF_REG_0, NSEC_PER_SEC, 1));
+	emit(prog, JMP_IMM(JMP_JA, 0, 0, 1));
+	emit(prog, MOV_IMM(BPF_REG_0, NSEC_PER_SEC));
+
+	/* refill */
+	emit(prog, ALU_IMM(ALU_OP_MUL, BPF_REG_0, n));
+	emit(prog, LDXDW(BPF_REG_2, off, BPF_REG_1));
+	emit(prog, ALU(ALU_OP_ADD, BPF_REG_2, BPF_REG_0));
+	emit_ld_imm64(prog, BPF_REG_3, n * NSEC_PER_SEC);
+	emit(prog, JMP(JMP_JGT, BPF_REG_2, BPF_REG_3, 1));
+	emit(prog, JMP_IMM(JMP_JA, 0, 0, 1));
+	emit(prog, MOV(BPF_REG_2, BPF_REG_3));
+
+	/* take a token, if there is one */
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, JMP_IMM(JMP_JGE, BPF_REG_2, NSEC_PER_SEC, 1));
+	emit(prog, JMP_IMM(JMP_JA, 0, 0, 2));
+	emit(prog, ALU_IMM(ALU_OP_SUB, BPF_REG_2, NSEC_PER_SEC));
+	emit(prog, MOV_IMM(BPF_REG_0, 1));
+	emit(prog, STXDW(BPF_REG_1, off, BPF_REG_2));
+
+	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+}
+
+static int ratelimit_loc_assign(node_t *call)
+{
+	return sample_loc_assign(call);
+}
+
+static int ratelimit_annotate(node_t *call)
+{
+	return sample_site_annotate(call, NSEC_PER_SEC);
+}
+
+
+/* `x in $set` is parsed as in($set[x]), true if the key x exists in
+ * the map. the value is never loaded. */
+static int in_compile(node_t *call, prog_t *prog)
+{
+	node_t *map = call->call.vargs;
+	mdyn_t *mdyn = node_map_get_mdyn(map);
+	ssize_t key = map->map.rec->dyn.addr;
+
+	if (!mdyn->bloom) {
+		emit_map_lookup_raw(prog, mdyn->mapfd, key);
+		emit(prog, JMP_IMM(JMP_JEQ, BPF_REG_0, 0, 1));
+		emit(prog, MOV_IMM(BPF_REG_0, 1));
+		return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+	}
+
+#if HAVE_DECL_BPF_FUNC_MAP_PEEK_ELEM
+	/* bloom filters hold no values, peeking returns 0 if the key
+	 * might be in the set. */
+	emit_ld_mapfd(prog, BPF_REG_1, mdyn->mapfd);
+	emit(prog, MOV(BPF_REG_2, mem_base(key)));
+	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_2, key));
+	emit(prog, CALL(BPF_FUNC_map_peek_elem));
+	emit(prog, MOV_IMM(BPF_REG_1, 1));
+	emit(prog, JMP_IMM(JMP_JEQ, BPF_REG_0, 0, 1));
+	emit(prog, MOV_IMM(BPF_REG_1, 0));
+	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_1]);
+#else
+	return -ENOSYS;
+#endif
+}
+
+static int in_loc_assign(node_t *call)
+{
+	node_t *map = call->call.vargs;
+	mdyn_t *mdyn = node_map_get_mdyn(map);
+
+	/* a set that is only ever tested for membership has no value
+	 * type of its own, store numbers. */
+	if (!mdyn->map->dyn.size) {
+		mdyn->map->dyn.type = TYPE_INT;
+		mdyn->map->dyn.size = sizeof(int64_t);
+	}
+	map->dyn.type = mdyn->map->dyn.type;
+	map->dyn.size = mdyn->map->dyn.size;
+
+	map->dyn.loc = LOC_VIRTUAL;
+	return 0;
+}
+
+static int in_annotate(node_t *call)
+{
+	node_t *map = call->call.vargs;
+
+	if (!map || map->next || map->type != TYPE_MAP) {
+		_e("in() is used as: expression in $set");
+		return -EINVAL;
+	}
+
+	call->dyn.type = TYPE_INT;
+	call->dyn.size = sizeof(int64_t);
+	return 0;
+}
+
+/* latency() measures the time from function entry to return. a probe
+ * using it runs at the return, and is paired with a kprobe that
+ * records the entry time, see latency_pair. both sides get the id of
+ * the pair as their only argument, entry times are keyed by thread
+ * and id. */
+static char latency_id_tag[] = "<latency-id>";
+
+static node_t *latency_id_new(int id)
+{
+	node_t *n = node_int_new(id);
+
+	/* tells the generated id apart from anything the user wrote */
+	n->string = latency_id_tag;
+	return n;
+}
+
+static int latency_key(node_t *call, prog_t *prog)
+{
+	node_t *id = call->call.vargs;
+
+	emit(prog, CALL(BPF_FUNC_get_current_pid_tgid));
+	emit(prog, STXDW(BPF_REG_10, id->dyn.addr, BPF_REG_0));
+	emit(prog, MOV_IMM(BPF_REG_0, id->integer));
+	emit(prog, STXDW(BPF_REG_10, id->dyn.addr + sizeof(int64_t), BPF_REG_0));
+
+	emit(prog, CALL(BPF_FUNC_ktime_get_ns));
+	emit(prog, STXDW(BPF_REG_10, id->dyn.addr + 2 * sizeof(int64_t), BPF_REG_0));
+	return 0;
+}
+
+static int latency_compile(node_t *call, prog_t *prog)
+{
+	mdyn_t *mdyn = builtin_mdyn(node_get_script(call), "latency");
+	ssize_t key = call->call.vargs->dyn.addr;
+	ssize_t ts = key + 2 * sizeof(int64_t);
+
+	latency_key(call, prog);
+
+	if (!strcmp(node_get_pvdr(call)->name, "kprobe"))
+		return emit_map_update_raw(prog, mdyn->mapfd, key, ts, BPF_ANY);
+
+	/* no entry time, e.g. the function was entered before the
+	 * probes were attached, skip the rest of the probe. */
+	emit_map_lookup_raw(prog, mdyn->mapfd, key);
+	emit(prog, JMP_IMM(JMP_JNE, BPF_REG_0, 0, 2));
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, EXIT);
+
+	emit(prog, LDXDW(BPF_REG_1, 0, BPF_REG_0));
+	emit(prog, LDXDW(BPF_REG_0, ts, BPF_REG_10));
+	emit(prog, ALU(ALU_OP_SUB, BPF_REG_0, BPF_REG_1));
+	emit(prog, STXDW(BPF_REG_10, ts, BPF_REG_0));
+
+	emit_map_delete_raw(prog, mdyn->mapfd, key);
+	emit(prog, LDXDW(BPF_REG_0, ts, BPF_REG_10));
+	return emit_xfer_dyns(prog, &call->dyn, &dyn_reg[BPF_REG_0]);
+}
+
+static int latency_loc_assign(node_t *call)
+{
+	node_t *probe = node_get_probe(call);
+	node_t *id = call->call.vargs;
+
+	/* key followed by the current time */
+	id->dyn.loc  = LOC_VIRTUAL;
+	id->dyn.addr = node_probe_stack_get(probe, call, 3 * sizeof(int64_t));
+	if (id->dyn.addr < -STACK_MAX) {
+		_e("%s: out of stack space", node_str(call));
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+static int latency_annotate(node_t *call)
+{
+	const char *pvdr = node_get_pvdr(call)->name;
+
+	if (strcmp(pvdr, "kprobe") && strcmp(pvdr, "kretprobe")) {
+		_e("%s is only available in kprobes", node_str(call));
+		return -EINVAL;
+	}
+
+	/* only the pair id added by latency_pair */
+	if (call->call.n_vargs != 1 ||
+	    call->call.vargs->string != latency_id_tag) {
+		_e("%s takes no arguments", node_str(call));
+		return -EINVAL;
+	}
+
+	builtin_mdyn(node_get_script(call), "latency");
+
+	call->dyn.type = TYPE_INT;
+	call->dyn.size = sizeof(int64_t);
+	return 0;
+}
+
+static int latency_site_add(node_t *n, void *_id)
+{
+	node_t *id;
+
+	if (n->type != TYPE_CALL || strcmp(n->string, "latency"))
+		return 0;
+
+	if (n->call.vargs) {
+		_e("%s: latency() takes no arguments",
+		   node_get_probe(n)->string);
+		return -EINVAL;
+	}
+
+	id = latency_id_new(*(int *)_id);
+	id->parent = n;
+	n->call.vargs = id;
+	n->call.n_vargs++;
+	return 0;
+}
+
+/* rewrite kprobe:F { ... latency() ... }
+ * into    kretprobe:F { ... latency(id) ... }
+ *         kprobe:F { latency(id) }
+ */
+int latency_pair(node_t *script)
+{
+	node_t *probe, *entry;
+	char *func;
+	int err, id = 0;
+
+	for (probe = script->script.probes; probe; probe = probe->next) {
+		if (!node_probe_call_count(probe, "latency"))
+			continue;
+
+		if (!strncmp(probe->string, "kprobe:", 7)) {
+			if (node_probe_call_count(probe, "arg")) {
+				_e("%s: arg() is not available in probes using "
+				   "latency(), they run at function return",
+				   probe->string);
+				return -EINVAL;
+			}
+
+			func = probe->string + 7;
+		} else if (!strncmp(probe->string, "kretprobe:", 10)) {
+			func = probe->string + 10;
+		} else {
+			/* reported by latency_annotate */
+			continue;
+		}
+
+		/* entry times are keyed by thread and pair, nested
+		 * functions matched by the same wildcard would share a
+		 * key. */
+		if (strchr(func, '?') || strchr(func, '*')) {
+			_e("%s: latency() can not be used with wildcards",
+			   probe->string);
+			return -EINVAL;
+		}
+
+		if (node_probe_call_count(probe, "latency") > 1) {
+			_e("%s: latency() can only be called once per probe",
+			   probe->string);
+			return -EINVAL;
+		}
+
+		err = node_walk(probe, NULL, latency_site_add, &id);
+		if (err)
+			return err;
+
+		entry = node_probe_new(NULL, NULL,
+				       node_call_new(strdup("latency"),
+						     latency_id_new(id)));
+		asprintf(&entry->string, "kprobe:%s", func);
+		asprintf(&probe->string, "kretprobe:%s", func);
+		entry->parent = script;
+
+		/* skip over the new entry probe */
+		insque(entry, probe);
+		probe = entry;
+		id++;
+	}
+
+	return 0;
+}
+
+
+#define BUILTIN_INT_VOID(_name) {			\
+		.name     = #_name,			\
+		.annotate = int_noargs_annotate,	\
+		.compile  = _name ## _compile,		\
+	}
+
+#define BUILTIN(_name) {			\
+		.name     = #_name,		\
+		.annotate = _name ## _annotate,	\
+		.compile  = _name ## _compile,	\
+	}
+
+#define BUILTIN_LOC(_name) {				\
+		.name       = #_name,			\
+		.annotate   = _name ## _annotate,	\
+		.loc_assign = _name ## _loc_assign,	\
+		.compile    = _name ## _compile,	\
+	}
+
+#define BUILTIN_LEAF(_name) {			\
+		.name     = #_name,		\
+		.leaf     = 1,			\
+		.annotate = _name ## _annotate,	\
+		.compile  = _name ## _compile,	\
+	}
+
+#define BUILTIN_LEAF_LOC(_name) {			\
+		.name       = #_name,			\
+		.leaf       = 1,			\
+		.annotate   = _name ## _annotate,	\
+		.loc_assign = _name ## _loc_assign,	\
+		.compile    = _name ## _compile,	\
+	}
+
+#define BUILTIN_ALIAS_LEAF_LOC(_name, _real) {		\
+		.name       = #_name,			\
+		.leaf       = 1,			\
+		.annotate   = _real ## _annotate,	\
+		.loc_assign = _real ## _loc_assign,	\
+		.compile    = _real ## _compile,	\
+	}
+
+#define BUILTIN_ALIAS(_name, _real) {		\
+		.name     = #_name,		\
+		.annotate = _real ## _annotate,	\
+		.compile  = _real ## _compile,	\
+	}
+
+#define BUILTIN_ALIAS_LOC(_name, _real) {		\
+		.name       = #_name,		\
+		.annotate   = _real ## _annotate,	\
+		.loc_assign = _real ## _loc_assign,	\
+		.compile    = _real ## _compile,	\
+	}
+
+static builtin_t builtins[] = {
+	BUILTIN_LEAF_LOC(reg),
+	BUILTIN_LEAF_LOC(arg),
+	BUILTIN_LEAF_LOC(func),
+	BUILTIN_LEAF_LOC(retval),
+	BUILTIN_ALIAS_LEAF_LOC(probefunc, func),
+
+	BUILTIN_LOC(printf),
+	BUILTIN_INT_VOID(  gid),
+	BUILTIN_INT_VOID(  uid),
+	BUILTIN_INT_VOID( tgid),
+	BUILTIN_INT_VOID(  pid),
+	BUILTIN_INT_VOID(nsecs),
+	BUILTIN_INT_VOID( secs),
+	BUILTIN_INT_VOID(  cpu),
+
+	BUILTIN(comm),
+	BUILTIN_ALIAS(execname, comm),
+	BUILTIN(stack),
+	BUILTIN_LOC(count),
+	BUILTIN_LOC(quantize),
+	BUILTIN_LOC(llquantize),
+	BUILTIN_LOC(loglin),
+	BUILTIN_LOC(distinct),
+	BUILTIN_LOC(topk),
+	BUILTIN_LOC(stats),
+	BUILTIN_ALIAS_LOC(sum, stats),
+	BUILTIN_ALIAS_LOC(min, stats),
+	BUILTIN_ALIAS_LOC(max, stats),
+	BUILTIN_ALIAS_LOC(avg, stats),
+	BUILTIN_LEAF(log2),
+	BUILTIN_LOC(sample),
+	BUILTIN_LOC(ratelimit),
+	BUILTIN_LOC(latency),
+	BUILTIN_LOC(in),
+
+	BUILTIN_LEAF_LOC(strcmp),
+	BUILTIN_LOC(match),
+
+	{ .name = NULL }
+};
+
+static builtin_t *builtin_find(const char *name)
+{
+	builtin_t *bi;
+	
+	for (bi = builtins; bi->name; bi++)
+		if (!strcmp(bi->name, name))
+			return bi;
+
+	return 0;
+}
+
+int builtin_compile(node_t *call, prog_t *prog)
+{
+	builtin_t *bi = builtin_find(call->string);
+
+	if (!bi) {
+		_e("unknown builin '%s'", call->string);
+		return -ENOENT;
+	}
+
+	if (!bi->compile) {
+		_e("unable to compile '%s'", call->string);
+		return -ENOSYS;
+	}
+
+	return bi->compile(call, prog);
+}
+
+static int default_loc_assign(node_t *call)
+{
+	node_t *probe = node_get_probe(call);
+	node_t *varg;
+	int reg;
+
+	node_foreach(varg, call->call.vargs) {
+		switch (varg->dyn.type) {
+		case TYPE_INT:
+			reg = node_probe_reg_get(probe, varg, -1);
+			if (reg >= 0) {
+				varg->dyn.loc = LOC_REG;
+				varg->dyn.reg = reg;
+				continue;
+			}
+			/* no registers, fall-through and allocate on
+			 * the stack */
+		case TYPE_REC:
+		case TYPE_STR:
+			node_probe_mem_get(probe, varg, varg->dyn.size);
+			continue;
 
 
 		default:
@@ -756,5 +2354,8 @@ int builtin_annotate(node_t *call)
 		return -ENOSYS;
 	}
 
+	if (!bi->leaf)
+		call->dyn.clobber_regs = CALLER_REGS;
+
 	return bi->annotate(call);
 }
@@ -50,17 +50,6 @@ typedef struct kprobe {
 	} efds;
 } kprobe_t;
 
-static long
-perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
-		int cpu, int group_fd, unsigned long flags)
-{
-	int ret;
-
-	ret = syscall(__NR_perf_event_open, hw_event, pid, cpu,
-		      group_fd, flags);
-	return ret;
-}
-
 static int kprobe_event_id(kprobe_t *kp, const char *func)
 {
 	FILE *fp;
@@ -189,7 +178,7 @@ static int __kprobe_setup(node_t *probe, prog_t *prog, const char *type)
 		return -EIO;
 	}
 
-	kp->bfd = bpf_prog_load(prog->insns, prog->ip - prog->insns);
+	kp->bfd = prog_load(probe, prog, BPF_PROG_TYPE_KPROBE);
 	if (kp->bfd < 0) {
 		perror("bpf");
 		fprintf(stderr, "bpf verifier:\n%s\n", bpf_log_buf);
@@ -226,6 +215,19 @@ static int kprobe_teardown(node_t *probe)
 	return 0;
 }
 
+static int kprobe_detach(node_t *probe)
+{
+	kprobe_t *kp = probe->dyn.probe.pvdr_priv;
+	int i;
+
+	for (i = 0; i < kp->efds.len; i++) {
+		if (ioctl(kp->efds.fds[i], PERF_EVENT_IOC_DISABLE, 0))
+			return -errno;
+	}
+
+	return 0;
+}
+
 static int kprobe_compile(node_t *call, prog_t *prog)
 {
 	return builtin_compile(call, prog);
@@ -247,6 +249,7 @@ pvdr_t kprobe_pvdr = {
 	.loc_assign = kprobe_loc_assign,
 	.compile    = kprobe_compile,
 	.setup      = kprobe_setup,
+	.detach     = kprobe_detach,
 	.teardown   = kprobe_teardown,
 };
 
@@ -256,6 +259,7 @@ pvdr_t kretprobe_pvdr = {
 	.loc_assign =    kprobe_loc_assign,
 	.compile    =    kprobe_compile,
 	.setup      = kretprobe_setup,
+	.detach     =    kprobe_detach,
 	.teardown   =    kprobe_teardown,
 };
 
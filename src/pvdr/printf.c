@@ -18,7 +18,6 @@
  */
 
 #include <inttypes.h>
-#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -108,75 +107,90 @@ static void printf_output(node_t *script, void *rec)
 	}
 }
 
-void printf_drain(node_t *script)
+static mdyn_t *printf_mdyn(node_t *script)
 {
-	node_t *call, *rec;
 	mdyn_t *mdyn;
-	int64_t key;
-	char *val;
-	int err;
 
 	for (mdyn = script->dyn.script.mdyns; mdyn; mdyn = mdyn->next)
 		if (!strcmp(mdyn->map->string, "printf"))
-			break;
+			return mdyn;
+
+	return NULL;
+}
 
-	if (!mdyn) {
-		poll(NULL, 0, -1);
+void printf_flush(node_t *script)
+{
+	static int64_t key = 0;
+	node_t *rec;
+	mdyn_t *mdyn;
+	char *val;
+
+	mdyn = printf_mdyn(script);
+	if (!mdyn)
 		return;
-	}
 
-	call = mdyn->map;
-	rec  = call->call.vargs->next;
-	val  = malloc(rec->dyn.size);
+	rec = mdyn->map->call.vargs->next;
+	val = malloc(rec->dyn.size);
+	assert(val);
 
-	for (key = 0;;) {
-		err = bpf_map_lookup(mdyn->mapfd, &key, val);
-		if (err) {
-			err = usleep(200000);
-			if (err)
-				break;
-		} else {
-			printf_output(script, val);
-			bpf_map_delete(mdyn->mapfd, &key);
-			key++;
-			if (key >= (PRINTF_BUF_LEN - 1))
-				key = 0;
-		}
+	while (!bpf_map_lookup(mdyn->mapfd, &key, val)) {
+		printf_output(script, val);
+		bpf_map_delete(mdyn->mapfd, &key);
+		key++;
+		if (key >= (PRINTF_BUF_LEN - 1))
+			key = 0;
 	}
+
+	free(val);
 }
 
+int printf_active(node_t *script)
+{
+	return printf_mdyn(script) != NULL;
+}
 
-int printf_compile(node_t *call, prog_t *prog)
+static void printf_map_call(prog_t *prog, int func, int fd,
+			    int kbase, ssize_t koff, int vbase, ssize_t voff)
 {
-	node_t *rec = call->call.vargs->next;
-	int map_fd = node_map_get_fd(call);
+	emit_ld_mapfd(prog, BPF_REG_1, fd);
+	emit(prog, MOV(BPF_REG_2, kbase));
+	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_2, koff));
+
+	if (func == BPF_FUNC_map_update_elem) {
+		emit(prog, MOV(BPF_REG_3, vbase));
+		emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_3, voff));
+		emit(prog, MOV_IMM(BPF_REG_4, 0));
+	}
 
-	if (call->dyn.size > sizeof(int64_t)) {
-		size_t diff = call->dyn.size - sizeof(int64_t);
-		ssize_t addr = rec->dyn.addr + rec->dyn.size;
+	emit(prog, CALL(func));
+}
 
-		emit(prog, MOV_IMM(BPF_REG_0, 0));
-		for (; diff; addr += sizeof(int64_t), diff -= sizeof(int64_t))
-			emit(prog, STXDW(BPF_REG_10, addr, BPF_REG_0));
-	}
-		
+/* the key is at [kbase + koff], the record at [rbase + roff]. the
+ * record starts with the meta word. */
+static void printf_emit_slot(prog_t *prog, int fd, int kbase, ssize_t koff,
+			     int rbase, ssize_t roff)
+{
 	/* lookup index into print buffer, stored out-of-band after
 	 * the last entry */
 	emit(prog, MOV_IMM(BPF_REG_0, PRINTF_BUF_LEN - 1));
-	emit(prog, STXDW(BPF_REG_10, call->dyn.addr, BPF_REG_0));
-	emit_map_lookup_raw(prog, map_fd, call->dyn.addr);
+	emit(prog, STXDW(kbase, koff, BPF_REG_0));
+	printf_map_call(prog, BPF_FUNC_map_lookup_elem, fd, kbase, koff, 0, 0);
 
 	/* if we get a null pointer, index is 0 */
 	emit(prog, JMP_IMM(JMP_JNE, BPF_REG_0, 0, 2));
-	emit(prog, STXDW(BPF_REG_10, call->dyn.addr, BPF_REG_0));
+	emit(prog, STXDW(kbase, koff, BPF_REG_0));
 	emit(prog, JMP_IMM(JMP_JA, 0, 0, 5));
 
 	/* otherwise, get it from the out-of-band value */
-	emit_read_raw(prog, call->dyn.addr, BPF_REG_0, sizeof(int64_t));
+	emit(prog, MOV(BPF_REG_1, kbase));
+	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_1, koff));
+	emit(prog, MOV_IMM(BPF_REG_2, sizeof(int64_t)));
+	emit(prog, MOV(BPF_REG_3, BPF_REG_0));
+	emit(prog, CALL(BPF_FUNC_probe_read));
 
-	/* at this point call->dyn.addr is loaded with the index of
-	 * the buffer */
-	emit_map_lookup_raw(prog, map_fd, call->dyn.addr);
+	/* at this point the key is loaded with the index of the
+	 * buffer */
+	printf_map_call(prog, BPF_FUNC_map_lookup_elem, fd, kbase, koff, 0, 0);
 
 	/* lookup SHOULD return NULL, otherwise user-space has not
 	 * been able to empty the buffer in time. */
@@ -184,27 +198,73 @@ int printf_compile(node_t *call, prog_t *prog)
 
 	/* mark record with the overflow bit so that user-space at
 	 * least knows when data has been lost */
-	emit(prog, LDXDW(BPF_REG_0, rec->rec.vargs->dyn.addr, BPF_REG_10));
+	emit(prog, LDXDW(BPF_REG_0, roff, rbase));
 	emit(prog, ALU_IMM(ALU_OP_OR, BPF_REG_0, PRINTF_META_OF));
-	emit(prog, STXDW(BPF_REG_10, rec->rec.vargs->dyn.addr, BPF_REG_0));
+	emit(prog, STXDW(rbase, roff, BPF_REG_0));
 
 	/* store record */
-	emit_map_update_raw(prog, map_fd, call->dyn.addr, rec->dyn.addr);
+	printf_map_call(prog, BPF_FUNC_map_update_elem, fd,
+			kbase, koff, rbase, roff);
 
 	/* calculate next index and store that in the record */
-	emit(prog, LDXDW(BPF_REG_0, call->dyn.addr, BPF_REG_10));
+	emit(prog, LDXDW(BPF_REG_0, koff, kbase));
 	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_0, 1));
 	emit(prog, JMP_IMM(JMP_JNE, BPF_REG_0, PRINTF_BUF_LEN - 1, 1));
 	emit(prog, MOV_IMM(BPF_REG_0, 0));
-	emit(prog, STXDW(BPF_REG_10, rec->rec.vargs->dyn.addr, BPF_REG_0));
+	emit(prog, STXDW(rbase, roff, BPF_REG_0));
 
 	/* store next index */
 	emit(prog, MOV_IMM(BPF_REG_0, PRINTF_BUF_LEN - 1));
-	emit(prog, STXDW(BPF_REG_10, call->dyn.addr, BPF_REG_0));
-	emit_map_update_raw(prog, map_fd, call->dyn.addr, rec->dyn.addr);
+	emit(prog, STXDW(kbase, koff, BPF_REG_0));
+	printf_map_call(prog, BPF_FUNC_map_update_elem, fd,
+			kbase, koff, rbase, roff);
+}
+
+/* r1: key, r2: record. both are kept in callee saved registers
+ * across the helper calls. */
+static int printf_subprog_emit(prog_t *prog, node_t *call)
+{
+	emit(prog, MOV(BPF_REG_6, BPF_REG_1));
+	emit(prog, MOV(BPF_REG_7, BPF_REG_2));
+	printf_emit_slot(prog, node_map_get_fd(call), BPF_REG_6, 0, BPF_REG_7, 0);
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, EXIT);
 	return 0;
 }
 
+static const subprog_t printf_subprog = {
+	.name = "printf",
+	.emit = printf_subprog_emit,
+};
+
+int printf_compile(node_t *call, prog_t *prog)
+{
+	node_t *rec = call->call.vargs->next;
+	int map_fd = node_map_get_fd(call);
+
+	if (call->dyn.size > sizeof(int64_t)) {
+		size_t diff = call->dyn.size - sizeof(int64_t);
+		ssize_t addr = rec->dyn.addr + rec->dyn.size;
+
+		emit(prog, MOV_IMM(BPF_REG_0, 0));
+		for (; diff; addr += sizeof(int64_t), diff -= sizeof(int64_t))
+			emit(prog, STXDW(mem_base(addr), addr, BPF_REG_0));
+	}
+
+	if (!subprog_shared(prog, call)) {
+		printf_emit_slot(prog, map_fd,
+				 mem_base(call->dyn.addr), call->dyn.addr,
+				 mem_base(rec->dyn.addr), rec->dyn.addr);
+		return 0;
+	}
+
+	emit(prog, MOV(BPF_REG_1, mem_base(call->dyn.addr)));
+	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_1, call->dyn.addr));
+	emit(prog, MOV(BPF_REG_2, mem_base(rec->dyn.addr)));
+	emit(prog, ALU_IMM(ALU_OP_ADD, BPF_REG_2, rec->dyn.addr));
+	return emit_subprog_call(prog, &printf_subprog, call);
+}
+
 static int printf_walk(node_t *n, void *_mdyn)
 {
 	mdyn_t *mdyn = _mdyn;
@@ -279,12 +339,11 @@ int printf_loc_assign(node_t *call)
 	varg->dyn.loc = LOC_VIRTUAL;
 
 	rec_max_size  = printf_rec_size(probe->parent);
-	rec->dyn.loc  = LOC_STACK;
-	rec->dyn.addr = node_probe_stack_get(probe, rec_max_size);
+	node_probe_mem_get(probe, rec, rec_max_size);
 
 	/* allocate storage for printf's map key */
 	call->dyn.size = rec_max_size + sizeof(int64_t) - rec->dyn.size;
-	call->dyn.addr = node_probe_stack_get(probe, call->dyn.size);
+	node_probe_mem_get(probe, call, call->dyn.size);
 	return 0;
 }
 
@@ -0,0 +1,291 @@
+/*
+ * Copyright 2015-2016 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/bpf.h>
+#include <linux/perf_event.h>
+
+#include <sys/ioctl.h>
+
+#include "../ply.h"
+#include "../bpf-syscall.h"
+#include "pvdr.h"
+
+#define CPU_ONLINE "/sys/devices/system/cpu/online"
+
+typedef struct profile {
+	int bfd;
+
+	int  n_efds;
+	int *efds;
+} profile_t;
+
+static int profile_attach_cpu(profile_t *prof, struct perf_event_attr *attr,
+			      int cpu)
+{
+	int efd;
+
+	efd = perf_event_open(attr, -1/*pid*/, cpu, -1/*group_fd*/, 0);
+	if (efd < 0) {
+		_pe("perf_event_open, cpu%d", cpu);
+		return -errno;
+	}
+
+	if (ioctl(efd, PERF_EVENT_IOC_SET_BPF, prof->bfd)) {
+		_pe("perf-set-bpf, cpu%d", cpu);
+		close(efd);
+		return -errno;
+	}
+
+	if (ioctl(efd, PERF_EVENT_IOC_ENABLE, 0)) {
+		_pe("perf enable, cpu%d", cpu);
+		close(efd);
+		return -errno;
+	}
+
+	prof->efds[prof->n_efds++] = efd;
+	return 0;
+}
+
+/* online CPUs are listed as ranges, e.g. "0-3,6,8-9". ids are not
+ * necessarily contiguous when CPUs have been taken offline. */
+static int profile_cpus(int **cpus)
+{
+	FILE *fp;
+	int from, to, sep, n = 0, cap = 0;
+
+	fp = fopen(CPU_ONLINE, "r");
+	if (!fp) {
+		_pe("unable to read " CPU_ONLINE);
+		return -errno;
+	}
+
+	*cpus = NULL;
+	while (fscanf(fp, "%d", &from) == 1) {
+		to = from;
+
+		sep = fgetc(fp);
+		if (sep == '-') {
+			if (fscanf(fp, "%d", &to) != 1)
+				break;
+
+			sep = fgetc(fp);
+		}
+
+		for (; from <= to; from++) {
+			if (n == cap) {
+				cap = cap ? cap << 1 : 16;
+				*cpus = realloc(*cpus, cap * sizeof(**cpus));
+				assert(*cpus);
+			}
+
+			(*cpus)[n++] = from;
+		}
+
+		if (sep != ',')
+			break;
+	}
+
+	fclose(fp);
+
+	if (!n) {
+		_e("no online CPUs listed in " CPU_ONLINE);
+		free(*cpus);
+		return -EINVAL;
+	}
+
+	return n;
+}
+
+static int __profile_setup(node_t *probe, prog_t *prog,
+			   struct perf_event_attr *attr, int all)
+{
+	profile_t *prof;
+	int *cpus, ncpus, i, err = 0;
+
+	ncpus = profile_cpus(&cpus);
+	if (ncpus < 0)
+		return ncpus;
+
+	if (!all)
+		ncpus = 1;
+
+	prof = calloc(1, sizeof(*prof));
+	assert(prof);
+	prof->efds = calloc(ncpus, sizeof(*prof->efds));
+	assert(prof->efds);
+
+	probe->dyn.probe.pvdr_priv = prof;
+
+	prof->bfd = prog_load(probe, prog, BPF_PROG_TYPE_PERF_EVENT);
+	if (prof->bfd < 0) {
+		perror("bpf");
+		fprintf(stderr, "bpf verifier:\n%s\n", bpf_log_buf);
+		free(cpus);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ncpus; i++) {
+		err = profile_attach_cpu(prof, attr, cpus[i]);
+		if (err)
+			break;
+	}
+
+	free(cpus);
+	return err ? : prof->n_efds;
+}
+
+static int profile_setup(node_t *probe, prog_t *prog)
+{
+	struct perf_event_attr attr = {};
+	char *hz;
+
+	/* profile:hz:N */
+	hz = strchr(probe->string, ':') + 1;
+	if (strncmp(hz, "hz:", 3)) {
+		_e("unknown profile spec '%s', expected profile:hz:N",
+		   probe->string);
+		return -EINVAL;
+	}
+
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_CPU_CLOCK;
+	attr.freq = 1;
+	attr.sample_freq = isdigit(hz[3]) ? strtoul(hz + 3, NULL, 0) : 0;
+	if (!attr.sample_freq) {
+		_e("profile frequency must be a positive integer");
+		return -EINVAL;
+	}
+
+	return __profile_setup(probe, prog, &attr, 1);
+}
+
+static int interval_setup(node_t *probe, prog_t *prog)
+{
+	struct perf_event_attr attr = {};
+	char *spec, *unit;
+	uint64_t period, scale = 0;
+
+	/* interval:N[s|ms|us] */
+	spec = strchr(probe->string, ':') + 1;
+	period = strtoull(spec, &unit, 0);
+
+	if (!*unit || !strcmp(unit, "s"))
+		scale = 1000000000;
+	else if (!strcmp(unit, "ms"))
+		scale = 1000000;
+	else if (!strcmp(unit, "us"))
+		scale = 1000;
+
+	/* strtoull(3) negates "-1" into a huge period */
+	if (!scale || !isdigit(*spec) || period > UINT64_MAX / scale)
+		period = 0;
+	else
+		period *= scale;
+
+	if (!period) {
+		_e("unknown interval spec '%s', expected interval:N[s|ms|us]",
+		   probe->string);
+		return -EINVAL;
+	}
+
+	/* a single timer pinned to the first online CPU, the probe should
+	 * fire once per period, not once per CPU. */
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_CPU_CLOCK;
+	attr.sample_period = period;
+
+	return __profile_setup(probe, prog, &attr, 0);
+}
+
+static int profile_teardown(node_t *probe)
+{
+	profile_t *prof = probe->dyn.probe.pvdr_priv;
+	int i;
+
+	for (i = 0; i < prof->n_efds; i++)
+		close(prof->efds[i]);
+
+	close(prof->bfd);
+	free(prof->efds);
+	free(prof);
+	return 0;
+}
+
+static int profile_detach(node_t *probe)
+{
+	profile_t *prof = probe->dyn.probe.pvdr_priv;
+	int i;
+
+	for (i = 0; i < prof->n_efds; i++) {
+		if (ioctl(prof->efds[i], PERF_EVENT_IOC_DISABLE, 0))
+			return -errno;
+	}
+
+	return 0;
+}
+
+static int profile_compile(node_t *call, prog_t *prog)
+{
+	return builtin_compile(call, prog);
+}
+
+static int profile_loc_assign(node_t *call)
+{
+	return builtin_loc_assign(call);
+}
+
+static int profile_annotate(node_t *call)
+{
+	return builtin_annotate(call);
+}
+
+pvdr_t profile_pvdr = {
+	.name = "profile",
+	.annotate   = profile_annotate,
+	.loc_assign = profile_loc_assign,
+	.compile    = profile_compile,
+	.setup      = profile_setup,
+	.detach     = profile_detach,
+	.teardown   = profile_teardown,
+};
+
+pvdr_t interval_pvdr = {
+	.name = "interval",
+	.annotate   = profile_annotate,
+	.loc_assign = profile_loc_assign,
+	.compile    = profile_compile,
+	.setup      = interval_setup,
+	.detach     = profile_detach,
+	.teardown   = profile_teardown,
+};
+
+__attribute__((constructor))
+static void profile_pvdr_register(void)
+{
+	pvdr_register( &profile_pvdr);
+	pvdr_register(&interval_pvdr);
+}
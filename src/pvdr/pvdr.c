@@ -31,13 +31,15 @@ pvdr_t *pvdr_find(const char *pspec)
 {
 	pvdr_t *pvdr;
 	char *colon;
+	size_t len;
 
+	/* special probes, e.g. BEGIN, are named by the provider
+	 * alone */
 	colon = strchr(pspec, ':');
-	if (!colon)
-		return NULL;
-	
+	len = colon ? (size_t)(colon - pspec) : strlen(pspec);
+
 	TAILQ_FOREACH(pvdr, &pvdr_list, node) {
-		if (!strncmp(pvdr->name, pspec, colon - pspec))
+		if (strlen(pvdr->name) == len && !strncmp(pvdr->name, pspec, len))
 			return pvdr;
 	}
 
@@ -48,6 +50,11 @@ int pvdr_resolve(node_t *script)
 {	
 	node_t *probe;
 	pvdr_t *pvdr;
+	int err;
+
+	err = latency_pair(script);
+	if (err)
+		return err;
 
 	for (probe = script->script.probes; probe; probe = probe->next) {
 		pvdr = pvdr_find(probe->string);
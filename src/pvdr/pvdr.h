@@ -34,6 +34,9 @@ typedef struct pvdr {
 	int (*loc_assign)(node_t *call);
 	int  (*compile)  (node_t *call,  prog_t *prog);
 	int    (*setup)  (node_t *probe, prog_t *prog);
+	int    (*start)  (node_t *probe);
+	int     (*stop)  (node_t *probe);
+	int   (*detach)  (node_t *probe);
 	int (*teardown)  (node_t *probe);
 } pvdr_t;
 
@@ -45,7 +48,10 @@ int builtin_compile   (node_t *call, prog_t *prog);
 int builtin_loc_assign(node_t *call);
 int builtin_annotate  (node_t *call);
 
-void printf_drain     (node_t *script);
+int latency_pair(node_t *script);
+
+int  printf_active    (node_t *script);
+void printf_flush     (node_t *script);
 int  printf_compile   (node_t *call, prog_t *prog);
 int  printf_loc_assign(node_t *call);
 int  printf_annotate  (node_t *call);
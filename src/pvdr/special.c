@@ -0,0 +1,294 @@
+/*
+ * Copyright 2015-2016 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/bpf.h>
+#include <linux/perf_event.h>
+
+#include <sys/ioctl.h>
+
+#include "../ply.h"
+#include "../bpf-syscall.h"
+#include "pvdr.h"
+
+/* BEGIN and END are implemented as uprobes on the trigger functions
+ * below, inside ply itself. The probes are then fired by simply
+ * calling the functions at the appropriate time. */
+
+typedef struct special {
+	const char *name;
+	void (*trigger)(void);
+
+	int bfd, efd;
+} special_t;
+
+void __attribute__((noinline)) special_begin_trigger(void)
+{
+	asm volatile ("");
+}
+
+void __attribute__((noinline)) special_end_trigger(void)
+{
+	asm volatile ("");
+}
+
+static int special_offset(void (*func)(void), char *exe, uint64_t *offs)
+{
+	FILE *maps;
+	char line[PATH_MAX + 128], perm[8], *path;
+	uintptr_t addr = (uintptr_t)func, start, end;
+	uint64_t pgoff;
+	int err = -ENOENT;
+
+	maps = fopen("/proc/self/maps", "r");
+	if (!maps) {
+		_pe("unable to read memory map");
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), maps)) {
+		if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %7s %" SCNx64,
+			   &start, &end, perm, &pgoff) != 4)
+			continue;
+
+		if (addr < start || addr >= end || !strchr(perm, 'x'))
+			continue;
+
+		path = strchr(line, '/');
+		if (!path)
+			break;
+
+		path[strcspn(path, "\n")] = '\0';
+		strcpy(exe, path);
+		*offs = addr - start + pgoff;
+		err = 0;
+		break;
+	}
+
+	fclose(maps);
+	return err;
+}
+
+static int special_event_id(special_t *sp, FILE *ctrl)
+{
+	FILE *fp;
+	char *ev_id, ev_str[16], exe[PATH_MAX];
+	uint64_t offs = 0;
+	int err;
+
+	err = special_offset(sp->trigger, exe, &offs);
+	if (err) {
+		_e("unable to locate %s trigger", sp->name);
+		return err;
+	}
+
+	fprintf(ctrl, "p:ply%d/%s %s:0x%" PRIx64 "\n",
+		getpid(), sp->name, exe, offs);
+	fflush(ctrl);
+
+	asprintf(&ev_id, "/sys/kernel/debug/tracing/events/ply%d/%s/id",
+		 getpid(), sp->name);
+	fp = fopen(ev_id, "r");
+	free(ev_id);
+	if (!fp) {
+		_pe("unable to create uprobe for %s", sp->name);
+		return -EIO;
+	}
+
+	fgets(ev_str, sizeof(ev_str), fp);
+	fclose(fp);
+	return strtol(ev_str, NULL, 0);
+}
+
+static void special_event_del(special_t *sp)
+{
+	FILE *ctrl;
+
+	ctrl = fopen("/sys/kernel/debug/tracing/uprobe_events", "a");
+	if (!ctrl)
+		return;
+
+	fprintf(ctrl, "-:ply%d/%s\n", getpid(), sp->name);
+	fclose(ctrl);
+}
+
+static int __special_setup(node_t *probe, prog_t *prog, special_t *sp)
+{
+	struct perf_event_attr attr = {};
+	FILE *ctrl;
+	int id, err;
+
+	if (sp->efd) {
+		_e("only one %s probe is allowed", probe->string);
+		return -EINVAL;
+	}
+
+	probe->dyn.probe.pvdr_priv = sp;
+
+	ctrl = fopen("/sys/kernel/debug/tracing/uprobe_events", "a");
+	if (!ctrl) {
+		perror("unable to open uprobe_events");
+		return -EIO;
+	}
+
+	id = special_event_id(sp, ctrl);
+	fclose(ctrl);
+	if (id < 0) {
+		err = id;
+		goto err_del;
+	}
+
+	sp->bfd = prog_load(probe, prog, BPF_PROG_TYPE_KPROBE);
+	if (sp->bfd < 0) {
+		perror("bpf");
+		fprintf(stderr, "bpf verifier:\n%s\n", bpf_log_buf);
+		err = -EINVAL;
+		goto err_del;
+	}
+
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.sample_type = PERF_SAMPLE_RAW;
+	attr.sample_period = 1;
+	attr.wakeup_events = 1;
+	attr.config = id;
+
+	/* only trigger on ourselves */
+	sp->efd = perf_event_open(&attr, getpid(), -1/*cpu*/, -1/*group_fd*/, 0);
+	if (sp->efd < 0) {
+		err = -errno;
+		_pe("perf_event_open: %s", sp->name);
+		goto err_bfd;
+	}
+
+	if (ioctl(sp->efd, PERF_EVENT_IOC_SET_BPF, sp->bfd)) {
+		err = -errno;
+		_pe("perf-set-bpf: %s", sp->name);
+		goto err_efd;
+	}
+
+	if (ioctl(sp->efd, PERF_EVENT_IOC_ENABLE, 0)) {
+		err = -errno;
+		_pe("perf enable: %s", sp->name);
+		goto err_efd;
+	}
+
+	return 1;
+
+	/* ply's own teardown never runs for a probe that failed, do not
+	 * leave the uprobe behind in tracefs. */
+err_efd:
+	close(sp->efd);
+err_bfd:
+	close(sp->bfd);
+err_del:
+	special_event_del(sp);
+	sp->efd = sp->bfd = 0;
+	return err;
+}
+
+static special_t begin_special = {
+	.name    = "begin",
+	.trigger = special_begin_trigger,
+};
+
+static special_t end_special = {
+	.name    = "end",
+	.trigger = special_end_trigger,
+};
+
+static int begin_setup(node_t *probe, prog_t *prog)
+{
+	return __special_setup(probe, prog, &begin_special);
+}
+
+static int end_setup(node_t *probe, prog_t *prog)
+{
+	return __special_setup(probe, prog, &end_special);
+}
+
+static int special_fire(node_t *probe)
+{
+	special_t *sp = probe->dyn.probe.pvdr_priv;
+
+	sp->trigger();
+	return 0;
+}
+
+static int special_teardown(node_t *probe)
+{
+	special_t *sp = probe->dyn.probe.pvdr_priv;
+
+	close(sp->efd);
+	close(sp->bfd);
+
+	special_event_del(sp);
+	return 0;
+}
+
+static int special_compile(node_t *call, prog_t *prog)
+{
+	return builtin_compile(call, prog);
+}
+
+static int special_loc_assign(node_t *call)
+{
+	return builtin_loc_assign(call);
+}
+
+static int special_annotate(node_t *call)
+{
+	return builtin_annotate(call);
+}
+
+pvdr_t begin_pvdr = {
+	.name = "BEGIN",
+	.annotate   = special_annotate,
+	.loc_assign = special_loc_assign,
+	.compile    = special_compile,
+	.setup      = begin_setup,
+	.start      = special_fire,
+	.teardown   = special_teardown,
+};
+
+pvdr_t end_pvdr = {
+	.name = "END",
+	.annotate   = special_annotate,
+	.loc_assign = special_loc_assign,
+	.compile    = special_compile,
+	.setup      = end_setup,
+	.stop       = special_fire,
+	.teardown   = special_teardown,
+};
+
+__attribute__((constructor))
+static void special_pvdr_register(void)
+{
+	pvdr_register(&begin_pvdr);
+	pvdr_register(  &end_pvdr);
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2015-2016 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <linux/bpf.h>
+
+#include "ply.h"
+#include "bpf-syscall.h"
+#include "compile.h"
+#include "stats.h"
+
+#define STATS_SYSCTL "/proc/sys/kernel/bpf_stats_enabled"
+
+static int stats_enabled;
+
+/* run_cnt and run_time_ns were added in 5.1 */
+#ifdef HAVE_STRUCT_BPF_PROG_INFO_RUN_TIME_NS
+
+/* the kernel only accounts run-time while someone holds an fd from
+ * BPF_ENABLE_STATS, or while the sysctl is set. */
+static int stats_fd = -1;
+static int stats_sysctl;
+
+static int stats_sysctl_set(int val)
+{
+	FILE *fp;
+	int old;
+
+	fp = fopen(STATS_SYSCTL, "r+");
+	if (!fp)
+		return -errno;
+
+	if (fscanf(fp, "%d", &old) != 1)
+		old = 0;
+
+	rewind(fp);
+	fprintf(fp, "%d\n", val);
+	if (fclose(fp))
+		return -errno;
+
+	return old;
+}
+
+int stats_enable(void)
+{
+	int old;
+
+#if HAVE_DECL_BPF_ENABLE_STATS
+	stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+	if (stats_fd >= 0) {
+		stats_enabled = 1;
+		return 0;
+	}
+#endif
+
+	/* before 5.8, fall back to the sysctl. it is global, so put
+	 * it back the way we found it when we are done. */
+	old = stats_sysctl_set(1);
+	if (old < 0) {
+		_e("unable to enable run-time statistics (%d)", old);
+		return old;
+	}
+
+	stats_sysctl = !old;
+	stats_enabled = 1;
+	return 0;
+}
+
+void stats_disable(void)
+{
+	if (stats_fd >= 0) {
+		close(stats_fd);
+		stats_fd = -1;
+	}
+
+	if (stats_sysctl) {
+		stats_sysctl_set(0);
+		stats_sysctl = 0;
+	}
+
+	stats_enabled = 0;
+}
+
+/* tail called parts run as part of the first one, the kernel only
+ * accounts for the program that was entered. */
+int stats_probe(node_t *probe, uint64_t *cnt, uint64_t *ns)
+{
+	struct bpf_prog_info info;
+
+	*cnt = *ns = 0;
+
+	if (bpf_prog_info(probe->dyn.probe.prog->fd, &info))
+		return -errno;
+
+	*cnt = info.run_cnt;
+	*ns  = info.run_time_ns;
+	return 0;
+}
+
+#else
+
+int stats_enable(void)
+{
+	_i("run-time statistics are not supported by this build");
+	return -ENOSYS;
+}
+
+void stats_disable(void)
+{
+}
+
+int stats_probe(node_t *probe, uint64_t *cnt, uint64_t *ns)
+{
+	*cnt = *ns = 0;
+	return -ENOSYS;
+}
+
+#endif
+
+void stats_report(node_t *script)
+{
+	node_t *probe;
+	uint64_t cnt, ns;
+
+	/* only the load-time statistics are available */
+	if (!stats_enabled)
+		return;
+
+	node_foreach(probe, script->script.probes) {
+		if (!probe->dyn.probe.prog)
+			continue;
+
+		if (stats_probe(probe, &cnt, &ns)) {
+			_pe("%s: unable to get program info", probe->string);
+			continue;
+		}
+
+		fprintf(stderr, "%s: %d event%s, %" PRIu64 " runs, "
+			"%" PRIu64 " ns, %" PRIu64 " ns/run\n",
+			probe->string, probe->dyn.probe.n_events,
+			(probe->dyn.probe.n_events == 1) ? "" : "s",
+			cnt, ns, cnt ? ns / cnt : 0);
+	}
+}